@@ -46,18 +46,20 @@ class MyFile {
   static zend_class_entry* class_entry;
   static zend_object_handlers handlers;
 
-  // Class methods may be stand-alone PHP_METHOD()s
-  // or a class may use the P3_METHOD_DECLARE() macro
-  // to define a method directly on a class.
-
-  P3_METHOD_DECLARE(__construct) {
-    zend_string *name, *mode;
-
-    if (zend_parse_parameters_throw(ZEND_NUM_ARGS(), "SS", &name, &mode)
-        == FAILURE) {
-      return;
-    }
+  // Holds no PHP values, so the cycle collector may skip it
+  static constexpr bool collectable = false;
 
+  // Class methods may be stand-alone PHP_METHOD()s,
+  // or a class may use the P3_METHOD_DECLARE() macro
+  // to define a method directly on a class and parse
+  // its own arguments with zend_parse_parameters().
+
+  // Plain C++ methods may instead be bound directly with P3_ME_NATIVE()
+  // or P3_STATIC_ME_NATIVE(), in which case arguments and the
+  // return value are converted automatically, and P3_ARGINFO()
+  // generates typed arginfo from the signature.
+  // Such methods must not be overloaded.
+  void __construct(const zend_string *name, const zend_string *mode) {
     bool rd = strchr(ZSTR_VAL(mode), 'r');
     bool ap = strchr(ZSTR_VAL(mode), 'a');
     bool wr = strchr(ZSTR_VAL(mode), 'w');
@@ -73,15 +75,34 @@ class MyFile {
     }
   }
 
-  // Static methods:
-  static P3_METHOD_DECLARE(getName) {
-    RETURN_STRING("MyFile");
+  /* {{{ proto string MyFile::read(int maxlen) */
+  zend_string* read(zend_long len) {
+    if (len < 1) {
+      zend_throw_exception(zend_ce_error, "Invalid length", 0);
+      return nullptr;
+    }
+
+    zend_string *ret = readBytes(len);
+    if (!ret) {
+      zend_throw_exception(zend_ce_error, "Failure reading from file", 0);
+    }
+    return ret;
+  }
+  /* }}} */
+
+  /* {{{ proto int MyFile::write(string data) */
+  zend_long write(const zend_string *data) {
+    ssize_t len = writeBytes(data);
+    if (len < 0) {
+      zend_throw_exception(zend_ce_error, "Failure writing to file", 0);
+    }
+    return len;
   }
+  /* }}} */
 
-  // Forward declare (See implementation below
-  // using P3_METHOD()
-  P3_METHOD_DECLARE(read);
-  P3_METHOD_DECLARE(write);
+  static zend_string* getName() {
+    return zend_string_init("MyFile", sizeof("MyFile") - 1, 0);
+  }
 
   // The rest of the object definition is typical
   // stuff you'd find on an object.
@@ -95,20 +116,21 @@ class MyFile {
     return fd > -1;
   }
 
-  ssize_t write(const zend_string* data) {
+  ssize_t writeBytes(const zend_string* data) {
     if (!isOpen()) { return -1; }
     return ::write(fd, ZSTR_VAL(data), ZSTR_LEN(data));
   }
 
-  zend_string* read(ssize_t len) {
+  zend_string* readBytes(size_t len) {
     if (!isOpen()) { return nullptr; }
     zend_string *ret = zend_string_alloc(len, 0);
-    ZSTR_LEN(ret) = ::read(fd, ZSTR_VAL(ret), len);
-    if (ZSTR_LEN(ret) < 0) {
+    ssize_t got = ::read(fd, ZSTR_VAL(ret), len);
+    if (got < 0) {
       zend_string_release(ret);
       return nullptr;
     }
-    ZSTR_VAL(ret)[ZSTR_LEN(ret)] = 0;
+    ZSTR_LEN(ret) = got;
+    ZSTR_VAL(ret)[got] = 0;
     return ret;
   }
 
@@ -124,56 +146,13 @@ class MyFile {
 zend_class_entry *MyFile::class_entry;
 zend_object_handlers MyFile::handlers;
 
-/* {{{ proto string MyFile::read(int maxlen) */
-ZEND_BEGIN_ARG_INFO_EX(read_arginfo, 0, ZEND_RETURN_VALUE, 1)
-  ZEND_ARG_INFO(0, read)
-ZEND_END_ARG_INFO()
-P3_METHOD(MyFile, read) {
-  zend_long len;
-
-  if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &len) == FAILURE) {
-    return;
-  }
-
-  if (len < 1) {
-    zend_throw_exception(zend_ce_error, "Invalid length", 0);
-    return;
-  }
-
-  zend_string *ret = read(len);
-  if (!ret) {
-    zend_throw_exception(zend_ce_error, "Failure reading from file", 0);
-    return;
-  }
-  RETURN_STR(ret);
-}
-/* }}} */
-
-/* {{{ proto int MyFile::write(string maxlen) */
-ZEND_BEGIN_ARG_INFO_EX(write_arginfo, 0, ZEND_RETURN_VALUE, 1)
-  ZEND_ARG_INFO(0, data)
-ZEND_END_ARG_INFO()
-P3_METHOD(MyFile, write) {
-  zend_string *data;
-
-  if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &data) == FAILURE) {
-    return;
-  }
-
-  int len = write(data);
-  if (len < 0) {
-    zend_throw_exception(zend_ce_error, "Failure writing to file", 0);
-    return;
-  }
-  RETURN_LONG(len);
-}
-/* }}} */
-
 static zend_function_entry php_myfile_methods[] = {
-  P3_ME(MyFile, __construct, nullptr, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
-  P3_ME(MyFile, read, read_arginfo, ZEND_ACC_PUBLIC)
-  P3_ME(MyFile, write, write_arginfo, ZEND_ACC_PUBLIC)
-  P3_STATIC_ME(MyFile, getName, nullptr, ZEND_ACC_PUBLIC)
+  P3_ME_NATIVE(MyFile, __construct, P3_CTOR_ARGINFO(MyFile, __construct),
+               ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+  P3_ME_NATIVE(MyFile, read, P3_ARGINFO(MyFile, read), ZEND_ACC_PUBLIC)
+  P3_ME_NATIVE(MyFile, write, P3_ARGINFO(MyFile, write), ZEND_ACC_PUBLIC)
+  P3_STATIC_ME_NATIVE(MyFile, getName, P3_ARGINFO(MyFile, getName),
+                      ZEND_ACC_PUBLIC)
   PHP_FE_END
 };
 
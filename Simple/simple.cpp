@@ -8,12 +8,15 @@
 #include <math.h>
 
 struct Simple {
-  P3_METHOD_DECLARE(takeANumber) {
-    RETURN_LONG(++counter);
-  }
+  zend_long takeANumber() { return ++counter; }
+  zend_long add(zend_long n) { return counter += n; }
+
+  std::string label;
 
   static zend_class_entry *class_entry;
   static zend_object_handlers handlers;
+  typedef p3::BinAllocator object_allocator;
+  static constexpr bool collectable = false;
 
   bool toBool() const { return counter; }
   zend_long toLong() const { return counter; }
@@ -30,19 +33,41 @@ struct Simple {
   }
   int compare(const Simple& that) const { return compare(that.counter); }
 
+  Simple operator+(zend_long n) const {
+    Simple ret(*this);
+    ret.counter += n;
+    return ret;
+  }
+  Simple operator+(const Simple& that) const { return *this + that.counter; }
+
  private:
   zend_long counter{0};
 };
 zend_class_entry *Simple::class_entry;
 zend_object_handlers Simple::handlers;
 
+struct SimpleChild : Simple {
+  static zend_class_entry *class_entry;
+  static zend_object_handlers handlers;
+};
+zend_class_entry *SimpleChild::class_entry;
+zend_object_handlers SimpleChild::handlers;
+
 static zend_function_entry php_simple_methods[] = {
-  P3_ME(Simple, takeANumber, nullptr, ZEND_ACC_PUBLIC)
+  P3_ME_NATIVE(Simple, takeANumber, P3_ARGINFO(Simple, takeANumber),
+               ZEND_ACC_PUBLIC)
+  P3_ME_NATIVE(Simple, add, P3_ARGINFO(Simple, add), ZEND_ACC_PUBLIC)
   PHP_FE_END
 };
 
+static p3::PropertyEntry php_simple_props[] = {
+  P3_PROPERTY(Simple, label)
+  P3_PROPERTY_END
+};
+
 static PHP_MINIT_FUNCTION(simple) {
-  p3::initClassEntry<Simple>("Simple", php_simple_methods);
+  p3::initClassEntry<Simple>("Simple", php_simple_methods, php_simple_props);
+  p3::initClassEntry<SimpleChild, Simple>("SimpleChild", nullptr);
   return SUCCESS;
 }
 
@@ -0,0 +1,33 @@
+--TEST--
+Property assignment coerces a copy, not the source variable
+--SKIPIF--
+<?php if (!extension_loaded('simple')) die('skip simple not loaded'); ?>
+--FILE--
+<?php
+class Name {
+  function __toString() { return 'name'; }
+}
+
+$o = new Simple;
+
+$n = 42;
+$o->label = $n;
+var_dump($o->label, $n);
+
+$s = new Name;
+$o->label = $s;
+var_dump($o->label, $s instanceof Name);
+
+try {
+  $o->label = [];
+} catch (TypeError $e) {
+  echo get_class($e), "\n";
+}
+var_dump($o->label);
+--EXPECT--
+string(2) "42"
+int(42)
+string(4) "name"
+bool(true)
+TypeError
+string(4) "name"
@@ -0,0 +1,33 @@
+--TEST--
+Operators accept instances of derived classes on either side
+--SKIPIF--
+<?php if (!extension_loaded('simple')) die('skip simple not loaded'); ?>
+--FILE--
+<?php
+$a = new SimpleChild;
+$a->add(2);
+$b = new SimpleChild;
+$b->add(3);
+$s = new Simple;
+$s->add(5);
+
+$c = $a + $b;
+var_dump(get_class($c), (int)$c);
+
+$c = $a + $s;
+var_dump(get_class($c), (int)$c);
+
+$c = $s + $b;
+var_dump(get_class($c), (int)$c);
+
+$a += $b;
+var_dump(get_class($a), (int)$a);
+--EXPECT--
+string(6) "Simple"
+int(5)
+string(6) "Simple"
+int(7)
+string(6) "Simple"
+int(8)
+string(6) "Simple"
+int(5)
@@ -1,6 +1,9 @@
 /**
  * C++ class wrapper for PHP7
  *
+ * Targets PHP 7.2 through 7.4; the handler signatures it fills in
+ * changed again in PHP 8.0, which is not supported.
+ *
  * Usage:
  *  Given a typical C++ class definition such as:
  *    class Foo {
@@ -31,6 +34,7 @@
  *    (float)$foo - double toDouble() const;
  *    (string)$foo - zend_string* toString() const;
  *    (array)$foo - zend_array* toArray() const;
+ *      String and array results are new references owned by the caller.
  *    (object)$foo - No proto required, jsut returns $foo unmodified
  *    (resource)$foo - Throws exception
  *
@@ -48,6 +52,146 @@
  *  If a specific comparator is not found, a generic fallback will be attempted:
  *    $foo <=> $whatever - int compare(const zval*) const;
  *
+ *  Public data members may be exposed as PHP properties by passing
+ *  a property table to initClassEntry():
+ *    static p3::PropertyEntry foo_props[] = {
+ *      P3_PROPERTY(Foo, count)          // $foo->count, read/write
+ *      P3_PROPERTY_READONLY(Foo, name)  // $foo->name, read only
+ *      P3_PROPERTY_END
+ *    };
+ *    p3::initClassEntry<Foo>("Foo", foo_methods, foo_props);
+ *  Supported member types are: bool, zend_long, double, std::string, zval,
+ *  zend_string*, zend_array*, zend_object* and zend_resource*.
+ *  Pointer members hold one reference, released by the object's destructor
+ *  (assignment releases the previous value), and nullptr reads as NULL.
+ *  Assignments are coerced as for internal function arguments,
+ *  and a TypeError is thrown when that is not possible.  The coercion
+ *  works on a copy, the assigned variable itself is left unchanged.
+ *  Names are interned at MINIT and resolved by pointer comparison,
+ *  falling back to the precomputed hash.  Other names are handled
+ *  by the standard property handlers.
+ *
+ *  Array style access ($foo[$key]) is mapped to container style methods,
+ *  for integer keys (zend_long) and/or string keys (const zend_string*).
+ *  Integer offsets are passed straight through, other scalar offsets
+ *  are converted as PHP would for an array key.
+ *    $foo[1] - R at(zend_long) const; or R operator[](zend_long) const;
+ *    $foo[1] = $x - U& operator[](zend_long);
+ *    isset($foo[1]) - bool contains(zend_long) const;
+ *    unset($foo[1]) - void erase(zend_long);
+ *  R and U may be any of the property member types listed above,
+ *  refcounted values are treated as owned by the container.
+ *  Assigned values are converted from a copy, exactly as for properties.
+ *  contains() is required for reading and writing, as the bounds check:
+ *  reads of missing keys raise a notice and evaluate to NULL, and writes
+ *  to them throw an Error, without calling at() or operator[].
+ *  Containers whose operator[] inserts missing keys (as std::map does)
+ *  may allow such writes by declaring:
+ *    static constexpr bool dim_insert = true;
+ *  Exceptions thrown by any of these are translated as for P3_ME (below).
+ *
+ *  Classes exposing C++ style iteration may be used with foreach:
+ *    foreach ($foo as $k => $v) - I begin() const; I end() const;
+ *  Elements are converted lazily as the loop advances.  std::pair elements
+ *  (as from std::map) yield first => second, anything else yields
+ *  0, 1, 2, ... => element.  The iterator holds a reference to the object,
+ *  but the container must not be modified while a loop is running.
+ *
+ *  Arithmetic and bitwise operators are mapped to the matching C++
+ *  operator, where A is one of const Foo&, zend_long, double or
+ *  const zend_string*, selected by the type of the right hand operand:
+ *    $foo + $x - R operator+(A) const;
+ *  Likewise for -, *, /, %, <<, >>, &, | and ^ (and their compound
+ *  assignments).  R may be Foo, which becomes a new Foo instance,
+ *  or any of the return types supported by P3_ME_NATIVE below.
+ *  Only the left hand operand is dispatched on, so `1 + $foo' is left
+ *  to the engine's default behavior.
+ *
+ *  Objects may be called as functions (e.g. as array_map() or usort()
+ *  callbacks) by implementing a single, non-overloaded operator():
+ *    $foo($x, $y) - R operator()(A1, A2, ...);
+ *  The call goes straight to operator(), with arguments and result
+ *  converted exactly as for P3_ME_NATIVE below, with no __invoke() method
+ *  in between.  A userland subclass defining __invoke() takes precedence.
+ *
+ *  Arrays of instances may be sorted natively, without going through
+ *  the compare handler for every pair.  Elements are unwrapped once
+ *  and ordered with int compare(const Foo&) const; directly:
+ *    p3::Owned<zend_array> p3::sort<Foo>(const zend_array *arr);
+ *    p3::Owned<zend_array> p3::stableSort<Foo>(const zend_array *arr);
+ *  Alternatively, a sort key may be extracted once per element:
+ *    K sortKey() const;
+ *    p3::Owned<zend_array> p3::sortByKey<Foo>(const zend_array *arr);
+ *  sortByKey() is stable, and uses a radix sort for integral and double
+ *  keys, other key types are compared with operator<.
+ *  Each returns a new list, or throws a TypeError (returning null)
+ *  when an element is not a Foo.  They may be bound as static methods:
+ *    P3_STATIC_ME_NATIVE(p3::SortMethods<Foo>, sort,
+ *                        P3_ARGINFO(p3::SortMethods<Foo>, sort),
+ *                        ZEND_ACC_PUBLIC) // Foo::sort([...])
+ *
+ *  count($foo) is mapped to the first of these which exists,
+ *  where N is any integral type (e.g. size_t or zend_long):
+ *    N size() const;
+ *    N count() const;
+ *
+ *  The matching engine interfaces are implemented automatically, along with
+ *  native methods they require (unless the class binds its own):
+ *    Countable - size() or count() as above, adds count()
+ *    Traversable - begin()/end() as above
+ *    (no interface) - toString(), adds __toString()
+ *    JsonSerializable - toArray(), adds jsonSerialize()
+ *  JsonSerializable comes from ext/json, which may be a shared extension
+ *  (before PHP 8), so it must start first.  Extensions relying on it should
+ *  declare the dependency, which is checked at MINIT:
+ *    static const zend_module_dep myext_deps[] = {
+ *      ZEND_MOD_OPTIONAL("json")
+ *      ZEND_MOD_END
+ *    };
+ *    zend_module_entry myext_module_entry = {
+ *      STANDARD_MODULE_HEADER_EX, nullptr, myext_deps, "myext", ...
+ *
+ *  serialize() and unserialize() are mapped to a compact binary encoding
+ *  of the C++ state, written and read back by:
+ *    void writeBinary(p3::Buffer& buf) const;
+ *    bool readBinary(p3::View view); // false when the data is invalid
+ *  e.g. buf.writeLong(m_id); buf.writeString(m_name); and in the same order
+ *       return view.readLong(m_id) && view.readString(m_name);
+ *  Integers and lengths are varint encoded, doubles are stored in native
+ *  byte order.  readBinary() is called on a default constructed instance.
+ *  On PHP 7.4+ the blob is wrapped as the single element of the array
+ *  returned by __serialize(), earlier versions use the class serialize
+ *  hooks (the C: format).  Properties of userland subclasses are not saved.
+ *
+ *  Objects may also write themselves as JSON without building an array:
+ *    void writeJson(p3::JsonWriter& json) const {
+ *      json.beginObject();
+ *      json.key("id"); json.value(m_id);
+ *      json.key("tags"); json.beginArray();
+ *      for (const auto& tag : m_tags) { json.value(tag); }
+ *      json.endArray();
+ *      json.endObject();
+ *    }
+ *  This adds a toJson() method returning the encoded string, and
+ *  a JsonWriter may also append to any smart_str from C++.  Strings must
+ *  be valid UTF-8 and are written unescaped apart from quotes, backslashes
+ *  and control characters.  ext/json offers no way to emit pre-encoded
+ *  JSON, so json_encode() still goes through jsonSerialize() (above).
+ *
+ *  A wrapped class may extend another wrapped class, in both C++ and PHP,
+ *  by naming the C++ base when initializing it (after the base):
+ *    class Bar : public Foo { ... };
+ *    p3::initClassEntry<Bar, Foo>("Bar", bar_methods);
+ *  Every handler is instantiated for Bar itself, so all dispatch remains
+ *  static and no virtual methods are needed.  Methods bound for Foo work
+ *  on Bar instances, and Foo's compare(const Foo&) accepts them as well.
+ *  Comparisons and operators Bar can't handle itself (e.g. against a Foo)
+ *  are passed on to Foo's handlers, and a Foo returned by an inherited
+ *  operator becomes a new Foo instance.
+ *  Foo must be the first (non-virtual) base of Bar, and may not declare
+ *  trailing_storage.  Bar inherits Foo's property table unless it passes
+ *  its own, which may list Foo's members too: P3_PROPERTY(Bar, fooMember)
+ *
  *  Additionally, methods on the class may be invoked directly from PHP
  *  by usage of three macros:
  *
@@ -71,6 +215,184 @@
  *  P3_STATIC_ME(cls, meth, arginfo, flags)
  *    Bind PHP static method to class static method
  *      Basically a vanity implementation of PHP_STATIC_ME
+ *
+ *  Plain C++ methods may also be bound without writing a P3_METHOD wrapper.
+ *  The parameter list is deduced at compile time and each argument is
+ *  unpacked with the inlined fast-ZPP converters, so no format string
+ *  is ever parsed.  The method must not be overloaded.
+ *
+ *  P3_ME_NATIVE(cls, meth, arginfo, flags)
+ *    Bind PHP instance method to a plain C++ member function
+ *      zend_long add(zend_long n); // $foo->add(1)
+ *
+ *  P3_STATIC_ME_NATIVE(cls, meth, arginfo, flags)
+ *    Bind PHP static method to a plain C++ static member function
+ *
+ *  C++ exceptions escaping a method bound by any of the four macros above
+ *  are caught and rethrown as PHP exceptions, rather than unwinding into
+ *  the engine.  The same goes for every handler calling into the class:
+ *  constructors run by `new' and clone, casts, comparisons, operators,
+ *  count(), array access, iteration and (un)serialization.
+ *  By default:
+ *    std::bad_alloc - Error("Out of memory")
+ *    std::exception - Exception(what())
+ *    anything else - Error("Unknown C++ exception")
+ *  Other mappings may be added from MINIT, later ones are tried first:
+ *    p3::mapException<std::out_of_range>(spl_ce_OutOfRangeException);
+ *  The message is taken from what() for types derived from std::exception.
+ *  Nothing is added when the extension is built without C++ exceptions.
+ *  Otherwise the cost is not zero, and has not been benchmarked: with
+ *  table based unwinding the happy path runs no extra checks, but the
+ *  try block keeps the wrapped call from being a tail call.
+ *  When a constructor throws, the engine is still handed a bare object,
+ *  which is never treated as a Foo: calling a bound method on it throws
+ *  an Error, and it is not accepted as a Foo operand.
+ *
+ *  Supported parameter types are: bool, zend_long, double,
+ *  zend_string*, zend_array*, zend_object*, zend_resource*
+ *  (or const pointers to the same) and zval* (any value).
+ *  Non-void return values are converted with the same type map,
+ *  and std::string is copied into a new PHP string.
+ *  Refcounted values are moved into the return value with exactly
+ *  the reference count they need:
+ *    zend_string* - New reference owned by the caller (as with RETURN_STR)
+ *    p3::Owned<zend_string> - Same, released automatically if not returned
+ *    p3::Borrowed<zend_string> - Existing reference, e.g. a cached member,
+ *                                a new reference is added for the caller
+ *    const zend_string* - Treated as borrowed, the same as p3::Borrowed
+ *  Any of zend_string, zend_array, zend_object or zend_resource may be used,
+ *  and a nullptr or empty handle is returned as NULL.
+ *
+ *  P3_ARGINFO(cls, meth)
+ *    Typed arginfo generated from the C++ signature of cls::meth,
+ *    for use as the arginfo argument of P3_ME_NATIVE/P3_STATIC_ME_NATIVE.
+ *    Parameters are named $arg1, $arg2, ... and typed from the same map,
+ *    zval* parameters are untyped, and the return type is declared as well
+ *    (void, or nullable for pointer returns).
+ *      P3_ME_NATIVE(Foo, add, P3_ARGINFO(Foo, add), ZEND_ACC_PUBLIC)
+ *
+ *  P3_CTOR_ARGINFO(cls, meth)
+ *    The same for a void __construct(), which may not declare a return type.
+ *      P3_ME_NATIVE(Foo, __construct, P3_CTOR_ARGINFO(Foo, __construct),
+ *                   ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+ *    Bad arguments to a constructor throw TypeError, as they would with
+ *    zend_parse_parameters_throw(), so `new' never returns an object
+ *    whose constructor body did not run.
+ *
+ *  Object storage is allocated by an allocation policy which may be
+ *  selected by declaring a member typedef on the class:
+ *    typedef p3::ZeroedAllocator object_allocator; // Default
+ *      ecalloc() the whole object, as zend_objects_new() would.
+ *    typedef p3::BinAllocator object_allocator;
+ *      emalloc() without zeroing the C++ object, so every member must be
+ *      initialized by the constructor.  When the class (not a subclass)
+ *      has no declared properties, the block size is a compile time
+ *      constant and ZendMM serves it straight from its size-class bin.
+ *  The engine releases the block with efree() after free_obj, so policies
+ *  must always return the start of an emalloc()'d block.
+ *
+ *  Members which only live as long as the request may draw memory from
+ *  a request scoped arena, a bump allocator releasing everything at once:
+ *    std::vector<Bar, p3::ArenaAllocator<Bar, Foo>> m_bars;
+ *  The second (optional) parameter attributes the memory to a class,
+ *  p3::RequestArena::usage<Foo>() returns the bytes it took this request.
+ *  Individual deallocations are free (only the most recent allocation is
+ *  actually reclaimed).  Objects are destroyed after RSHUTDOWN, so the
+ *  arena must be released from the post deactivate hook instead:
+ *    static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(myext) {
+ *      p3::RequestArena::instance().release();
+ *      return SUCCESS;
+ *    }
+ *  Nothing allocated from the arena may outlive the request.
+ *
+ *  Classes with costly constructors (preallocated buffers, open
+ *  descriptors, compiled state) may keep a bounded pool of instances
+ *  for reuse by later `new Foo' expressions within the request:
+ *    static constexpr size_t pool_size = 32;
+ *    void reset(); // Return to the default constructed state
+ *  On destruction the instance is reset() and moved into the pool
+ *  (when there is room), and new instances are move constructed from
+ *  a pooled one rather than default constructed, so the move constructor
+ *  must be cheap.  The engine frees the object's memory block either way,
+ *  only the C++ state is kept.  Pooled instances may hold request memory,
+ *  so the pool must be emptied from the post deactivate hook (see above):
+ *    p3::ObjectPool<Foo>::instance().clear();
+ *  For tuning, hits() and misses() count the instances served from the
+ *  pool and those constructed anew, and size() those currently parked.
+ *
+ *  State which is expensive to build (parsed configuration, compiled rule
+ *  sets, lookup tables, ...) may instead be built once per process, in
+ *  persistent memory, and shared by every request through read-only
+ *  proxy objects.  Given a plain class Rules, register the proxy class
+ *  and build the shared instance from MINIT:
+ *    static zend_function_entry rules_methods[] = {
+ *      P3_PERSISTENT_ME(Rules, match, P3_ARGINFO(Rules, match),
+ *                       ZEND_ACC_PUBLIC)
+ *      PHP_FE_END
+ *    };
+ *    p3::initClassEntry<p3::Persistent<Rules>>("Rules", rules_methods);
+ *    p3::Persistent<Rules>::init(ctor_args...);
+ *  `new Rules' and p3::Persistent<Rules>::proxy() then create proxies
+ *  pointing at the shared instance, as do clones.  Only const member
+ *  functions may be bound, and are otherwise converted as with
+ *  P3_ME_NATIVE.  Without init() a default constructed instance is built
+ *  on first use, which is not synchronized, so threaded (ZTS) builds must
+ *  call init() from MINIT.  Release it from MSHUTDOWN:
+ *    p3::Persistent<Rules>::shutdown();
+ *  The instance must not hold request bound values (emalloc()'d memory,
+ *  non-interned strings, arrays or objects).
+ *
+ *  Over-aligned classes are supported.  The C++ object is placed at the
+ *  start of the block and the zend_object follows it at the next suitably
+ *  aligned offset.  The block size is rounded up to a multiple of alignof(T)
+ *  so that ZendMM hands out a block on that boundary.  To keep instances
+ *  (and the zend_object) from sharing cache lines, align the whole class:
+ *    class alignas(p3::cacheLineSize) Foo { ... };
+ *
+ *  A class may reserve variable length storage inline, after the
+ *  zend_object and its properties, to avoid a second allocation for
+ *  a buffer it owns.  Declare the element type (which must be trivially
+ *  copyable) and the element count used by `new Foo`:
+ *    typedef p3::TrailingStorage<char, 8192> trailing_storage;
+ *  Instances with a different count may be created from C++ with:
+ *    zend_object *obj = p3::newObjectWithStorage<Foo>(count, ctor_args...);
+ *  The storage is reachable (from the constructor onward) via:
+ *    char *buf = p3::trailing(this);
+ *    size_t len = p3::trailingCount(this);
+ *  Clones receive a copy of the storage with the same element count.
+ *
+ *  Clones are made with T(const T&), a deep copy.  Immutable value classes
+ *  (e.g. with withFoo() methods returning a modified clone) may keep their
+ *  payload in a refcounted, copy-on-write block instead:
+ *    p3::Shared<HeaderMap> m_headers;
+ *  Copying the handle (and so the default copy constructor, and clone)
+ *  only adds a reference.  Reads go through *m_headers or m_headers->,
+ *  while m_headers.mutate() returns a writable payload, copying it first
+ *  if it is still shared.  The block is emalloc()'d, so it may not outlive
+ *  the request, and the reference count is not atomic.  Like a moved-from
+ *  std::unique_ptr, a moved-from handle is empty (false when tested) and
+ *  may only be assigned to or destroyed.
+ *
+ *  Classes which can never take part in a reference cycle (they hold no
+ *  zvals or other refcounted PHP values) may opt out of the cycle collector:
+ *    static constexpr bool collectable = false;
+ *  Instances are then never buffered as possible roots (PHP 7.3+), and
+ *  get_gc reports nothing to scan.  Before PHP 7.3 the collector picks
+ *  roots from the zval rather than the object, so instances may still be
+ *  buffered, and only the scan is skipped.  Instances of userland
+ *  subclasses declaring properties, or carrying dynamic properties,
+ *  are still scanned when found.
+ *
+ *  Classes which do hold PHP values (cached arrays, callbacks, ...) should
+ *  instead report them to the cycle collector, so that cycles running
+ *  through the C++ object can be found and freed:
+ *    void gcVisit(p3::GcBuffer& buf) const {
+ *      buf.add(&m_callback);  // zval
+ *      buf.add(m_cache);      // zend_array* or zend_object*, may be null
+ *    }
+ *  Values are only borrowed, no references are added.  The buffer belongs
+ *  to the instance and is reused between collections.  Declared and dynamic
+ *  properties of userland subclasses are reported automatically.
  */
 
 #ifndef incl_PHP_P3_H
@@ -82,25 +404,242 @@
 
 #include "php.h"
 #include "zend_exceptions.h"
+#include "zend_interfaces.h"
+#include "zend_smart_str.h"
+#include "zend_strtod.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <new>
+#include <string>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+# define P3_EXCEPTIONS 1
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define P3_JSON_SSE2 1
+#endif
 
 namespace p3 {
 
+constexpr size_t cacheLineSize = 64;
+
+constexpr size_t alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Values held by a wrapped object, reported to the collector (see gcVisit)
+class GcBuffer {
+ public:
+  GcBuffer() {}
+  GcBuffer(const GcBuffer&) = delete;
+  GcBuffer& operator=(const GcBuffer&) = delete;
+  ~GcBuffer() {
+    if (m_data) { efree(m_data); }
+  }
+
+  void add(const zval *value) {
+    if (Z_REFCOUNTED_P(value)) {
+      ZVAL_COPY_VALUE(next(), value);
+    }
+  }
+  void add(zend_object *obj) {
+    if (obj) { ZVAL_OBJ(next(), obj); }
+  }
+  void add(zend_array *arr) {
+    if (arr && !(GC_FLAGS(arr) & IS_ARRAY_IMMUTABLE)) {
+      ZVAL_ARR(next(), arr);
+    }
+  }
+
+  void clear() { m_used = 0; }
+  zval* data() { return m_data; }
+  int size() const { return m_used; }
+
+ private:
+  zval* next() {
+    if (UNEXPECTED(m_used == m_size)) {
+      m_size = m_size ? (m_size * 2) : 8;
+      m_data = reinterpret_cast<zval*>(
+        erealloc(m_data, m_size * sizeof(zval)));
+    }
+    return m_data + m_used++;
+  }
+
+  zval *m_data{nullptr};
+  int m_used{0};
+  int m_size{0};
+};
+
+namespace {
+template<class T>
+class gcVisitable {
+  template<class U>
+  static std::true_type test(decltype(std::declval<const U&>().gcVisit(
+                               std::declval<GcBuffer&>()))*);
+  template<class U>
+  static std::false_type test(...);
+ public:
+  static constexpr bool value = decltype(test<T>(nullptr))::value;
+};
+} // null namespace
+
+// Storage layout: [T][GcBuffer][padding][zend_object][properties_table]
+// The GcBuffer is only present for classes implementing gcVisit()
+template<class T>
+struct objectLayout {
+  static constexpr size_t alignment =
+    alignof(T) > ZEND_MM_ALIGNMENT ? alignof(T) : ZEND_MM_ALIGNMENT;
+  static constexpr size_t gcOffset = alignUp(sizeof(T), alignof(GcBuffer));
+  static constexpr size_t gcEnd =
+    gcVisitable<T>::value ? (gcOffset + sizeof(GcBuffer)) : sizeof(T);
+  // Offset of the zend_object from the start of the block (handlers.offset)
+  static constexpr size_t offset = alignUp(gcEnd, alignof(zend_object));
+  // zend_object ends with properties_table[1],
+  // so this is the size with no declared properties
+  static constexpr size_t base_size =
+    alignUp(offset + sizeof(zend_object) - sizeof(zval), alignment);
+
+  // End of the engine's part of the block (zend_object and properties)
+  static size_t propertiesEnd(zend_class_entry *ce) {
+    return offset + sizeof(zend_object) + zend_object_properties_size(ce);
+  }
+  static size_t size(zend_class_entry *ce, size_t extra = 0) {
+    return alignUp(propertiesEnd(ce) + extra, alignment);
+  }
+};
+
+// Inline storage following the properties table (see trailing_storage)
+template<typename Elem, size_t DefaultCount = 0>
+struct TrailingStorage {
+  static_assert(std::is_trivially_copyable<Elem>::value,
+                "Trailing storage elements must be trivially copyable");
+  typedef Elem element_type;
+  static constexpr bool enabled = true;
+  static constexpr size_t default_count = DefaultCount;
+};
+
+namespace {
+struct noTrailingStorage {
+  typedef char element_type;
+  static constexpr bool enabled = false;
+  static constexpr size_t default_count = 0;
+};
+
+template<class T>
+class trailingStorageOf {
+  template<class U>
+  static typename U::trailing_storage test(typename U::trailing_storage*);
+  template<class U>
+  static noTrailingStorage test(...);
+ public:
+  typedef decltype(test<T>(nullptr)) type;
+};
+} // null namespace
+
+// Trailing layout: [properties_table][size_t count][Elem data[count]]
+template<class T>
+struct trailingLayout {
+  typedef typename trailingStorageOf<T>::type storage;
+  typedef typename storage::element_type element_type;
+  static constexpr bool enabled = storage::enabled;
+
+  static size_t countOffset(zend_class_entry *ce) {
+    return alignUp(objectLayout<T>::propertiesEnd(ce), alignof(size_t));
+  }
+  static size_t dataOffset(zend_class_entry *ce) {
+    return alignUp(countOffset(ce) + sizeof(size_t), alignof(element_type));
+  }
+  // Bytes needed past the properties table for `count' elements
+  static size_t extra(zend_class_entry *ce, size_t count) {
+    if (!enabled) { return 0; }
+    return dataOffset(ce) - objectLayout<T>::propertiesEnd(ce) +
+           count * sizeof(element_type);
+  }
+
+  // These require zend_object::ce to be set (see allocObject)
+  static size_t& count(T *obj);
+  static element_type* data(T *obj);
+};
+
 template<class T>
 zend_object* toZendObject(T *obj) {
-  return reinterpret_cast<zend_object*>(obj + 1);
+  return reinterpret_cast<zend_object*>(
+    reinterpret_cast<char*>(obj) + objectLayout<T>::offset);
 }
 
+// The zend_object of a derived class (see initClassEntry<T, Base>) sits
+// further along, so go by the object's own handlers rather than T's layout
 template<class T>
 T* toObject(zend_object *obj) {
-  return reinterpret_cast<T*>(obj) - 1;
+  return reinterpret_cast<T*>(
+    reinterpret_cast<char*>(obj) - obj->handlers->offset);
 }
 
 template<class T>
 T* toObject(zval *obj) {
-  return reinterpret_cast<T*>(Z_OBJ_P(obj)) - 1;
+  return toObject<T>(Z_OBJ_P(obj));
+}
+
+// The bare object handed to the engine when a constructor threw
+// (see createObject()) keeps the standard handlers, with no T behind it
+inline bool isConstructed(const zend_object *obj) {
+  return obj->handlers != zend_get_std_object_handlers();
+}
+
+// toObject() for the object a method was called on,
+// throwing an Error and returning nullptr if it was never constructed
+template<class T>
+T* thisObject(zval *obj) {
+  if (UNEXPECTED(!isConstructed(Z_OBJ_P(obj)))) {
+    if (!EG(exception)) {
+      // Otherwise this is `new' calling __construct after the failure
+      zend_throw_error(nullptr, "%s object was not constructed",
+                       ZSTR_VAL(Z_OBJCE_P(obj)->name));
+    }
+    return nullptr;
+  }
+  return toObject<T>(obj);
+}
+
+template<class T>
+size_t& trailingLayout<T>::count(T *obj) {
+  return *reinterpret_cast<size_t*>(
+    reinterpret_cast<char*>(obj) + countOffset(toZendObject(obj)->ce));
+}
+
+template<class T>
+typename trailingLayout<T>::element_type* trailingLayout<T>::data(T *obj) {
+  return reinterpret_cast<element_type*>(
+    reinterpret_cast<char*>(obj) + dataOffset(toZendObject(obj)->ce));
+}
+
+template<class T>
+typename trailingLayout<T>::element_type* trailing(T *obj) {
+  static_assert(trailingLayout<T>::enabled,
+                "Class does not declare trailing_storage");
+  return trailingLayout<T>::data(obj);
+}
+
+template<class T>
+const typename trailingLayout<T>::element_type* trailing(const T *obj) {
+  return trailing(const_cast<T*>(obj));
+}
+
+template<class T>
+size_t trailingCount(const T *obj) {
+  static_assert(trailingLayout<T>::enabled,
+                "Class does not declare trailing_storage");
+  return trailingLayout<T>::count(const_cast<T*>(obj));
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -114,12 +653,53 @@ T* toObject(zval *obj) {
 #define P3_ME(cls, meth, arginfo, flags) \
   ZEND_FENTRY(meth, \
     [](INTERNAL_FUNCTION_PARAMETERS) { \
-      ::p3::toObject<cls>(getThis()) \
-        ->zim_##meth(INTERNAL_FUNCTION_PARAM_PASSTHRU); \
+      ::p3::callTranslated([&] { \
+        cls *self = ::p3::thisObject<cls>(getThis()); \
+        if (self) { self->zim_##meth(INTERNAL_FUNCTION_PARAM_PASSTHRU); } \
+      }); \
     }, arginfo, flags)
 
 #define P3_STATIC_ME(cls, meth, arginfo, flags) \
-  ZEND_FENTRY(meth, &cls::zim_##meth, arginfo, flags | ZEND_ACC_STATIC)
+  ZEND_FENTRY(meth, \
+    [](INTERNAL_FUNCTION_PARAMETERS) { \
+      ::p3::callTranslated([&] { \
+        cls::zim_##meth(INTERNAL_FUNCTION_PARAM_PASSTHRU); \
+      }); \
+    }, arginfo, flags | ZEND_ACC_STATIC)
+
+#define P3_ME_NATIVE(cls, meth, arginfo, flags) \
+  ZEND_FENTRY(meth, \
+    (&::p3::nativeMethod<decltype(&cls::meth), &cls::meth>::invoke), \
+    arginfo, flags)
+
+#define P3_STATIC_ME_NATIVE(cls, meth, arginfo, flags) \
+  ZEND_FENTRY(meth, \
+    (&::p3::nativeMethod<decltype(&cls::meth), &cls::meth>::invoke), \
+    arginfo, flags | ZEND_ACC_STATIC)
+
+#define P3_PERSISTENT_ME(cls, meth, arginfo, flags) \
+  ZEND_FENTRY(meth, \
+    (&::p3::persistentMethod<decltype(&cls::meth), &cls::meth>::invoke), \
+    arginfo, flags)
+
+#define P3_ARGINFO(cls, meth) \
+  ::p3::nativeArgInfo<decltype(&cls::meth)>::info
+
+#define P3_CTOR_ARGINFO(cls, meth) \
+  ::p3::nativeCtorArgInfo<decltype(&cls::meth)>::info
+
+#define P3_PROPERTY(cls, member) \
+  { #member, \
+    (&::p3::propertyAccess<decltype(&cls::member), &cls::member>::read), \
+    (&::p3::propertyAccess<decltype(&cls::member), &cls::member>::write), \
+    (&::p3::propertyAccess<decltype(&cls::member), &cls::member>::ptr) },
+
+#define P3_PROPERTY_READONLY(cls, member) \
+  { #member, \
+    (&::p3::propertyAccess<decltype(&cls::member), &cls::member>::read), \
+    nullptr, nullptr },
+
+#define P3_PROPERTY_END { nullptr, nullptr, nullptr, nullptr }
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -138,7 +718,7 @@ template<> struct phpType<IS_NULL> {
   static type get(zval *pzv) { ZEND_ASSERT(Z_TYPE_P(pzv) == IS_NULL); }
   static void make(zval *pzv) { ZVAL_NULL(pzv); }
 };
-template<> struct cppType<void> { const zend_uchar type = IS_NULL; };
+template<> struct cppType<void> { static constexpr zend_uchar type = IS_NULL; };
 template<> struct phpType<_IS_BOOL> {
   typedef zend_bool type;
   typedef zend_bool const_type;
@@ -147,8 +727,17 @@ template<> struct phpType<_IS_BOOL> {
     return Z_TYPE_P(pzv) == IS_TRUE;
   }
   static void make(zval *pzv, type bval) { ZVAL_BOOL(pzv, bval); }
+  static constexpr zend_expected_type expected = Z_EXPECTED_BOOL;
+  static bool parse(zval *pzv, type &bval) {
+    return zend_parse_arg_bool(pzv, &bval, nullptr, 0);
+  }
+};
+template<> struct cppType<zend_bool> {
+  static constexpr zend_uchar type = _IS_BOOL;
+};
+template<> struct cppType<bool> {
+  static constexpr zend_uchar type = _IS_BOOL;
 };
-template<> struct cppType<zend_bool> { const zend_uchar type = _IS_BOOL; };
 template<> struct phpType<IS_TRUE> {
   typedef zend_bool type;
   typedef zend_bool const_type;
@@ -175,8 +764,14 @@ template<> struct phpType<IS_LONG> {
     return Z_LVAL_P(pzv);
   }
   static void make(zval *pzv, type val) { ZVAL_LONG(pzv, val); }
+  static constexpr zend_expected_type expected = Z_EXPECTED_LONG;
+  static bool parse(zval *pzv, type &val) {
+    return zend_parse_arg_long(pzv, &val, nullptr, 0, 0);
+  }
+};
+template<> struct cppType<zend_long> {
+  static constexpr zend_uchar type = IS_LONG;
 };
-template<> struct cppType<zend_long> { const zend_uchar type = IS_LONG; };
 template<> struct phpType<IS_DOUBLE> {
   typedef double type;
   typedef double const_type;
@@ -185,9 +780,33 @@ template<> struct phpType<IS_DOUBLE> {
     return Z_DVAL_P(pzv);
   }
   static void make(zval *pzv, type val) { ZVAL_DOUBLE(pzv, val); }
+  static constexpr zend_expected_type expected = Z_EXPECTED_DOUBLE;
+  static bool parse(zval *pzv, type &val) {
+    return zend_parse_arg_double(pzv, &val, nullptr, 0);
+  }
 };
-template<> struct cppType<double> { const zend_uchar type = IS_DOUBLE; };
-#define P3_DECLARE_GCTYPE_DETAIL(dt, ctype, wrap, unwrap) \
+template<> struct cppType<double> {
+  static constexpr zend_uchar type = IS_DOUBLE;
+};
+inline bool parseArgString(zval *pzv, zend_string *&val) {
+  return zend_parse_arg_str(pzv, &val, 0);
+}
+inline bool parseArgArray(zval *pzv, zend_array *&val) {
+  return zend_parse_arg_array_ht(pzv, &val, 0, 0, 0);
+}
+inline bool parseArgObject(zval *pzv, zend_object *&val) {
+  zval *obj;
+  if (!zend_parse_arg_object(pzv, &obj, nullptr, 0)) return false;
+  val = Z_OBJ_P(obj);
+  return true;
+}
+inline bool parseArgResource(zval *pzv, zend_resource *&val) {
+  zval *res;
+  if (!zend_parse_arg_resource(pzv, &res, 0)) return false;
+  val = Z_RES_P(res);
+  return true;
+}
+#define P3_DECLARE_GCTYPE_DETAIL(dt, ctype, wrap, unwrap, expect, parser) \
 template<> struct phpType<dt> { \
   typedef ctype type; \
   typedef const ctype const_type; \
@@ -199,13 +818,23 @@ template<> struct phpType<dt> { \
     wrap(pzv, val); \
     if (cpy) zval_addref_p(pzv); \
   } \
+  static constexpr zend_expected_type expected = expect; \
+  static bool parse(zval *pzv, type &val) { return parser(pzv, val); } \
+}; \
+template<> struct cppType<ctype> { \
+  static constexpr zend_uchar type = dt; \
 }; \
-template<> struct cppType<ctype> { const zend_uchar type = dt; }; \
-template<> struct cppType<const ctype> { const zend_uchar type = dt; };
-P3_DECLARE_GCTYPE_DETAIL(IS_STRING,   zend_string*,   ZVAL_STR, Z_STR_P)
-P3_DECLARE_GCTYPE_DETAIL(IS_ARRAY,    zend_array*,    ZVAL_ARR, Z_ARR_P)
-P3_DECLARE_GCTYPE_DETAIL(IS_OBJECT,   zend_object*,   ZVAL_OBJ, Z_OBJ_P)
-P3_DECLARE_GCTYPE_DETAIL(IS_RESOURCE, zend_resource*, ZVAL_RES, Z_RES_P)
+template<> struct cppType<const ctype> { \
+  static constexpr zend_uchar type = dt; \
+};
+P3_DECLARE_GCTYPE_DETAIL(IS_STRING,   zend_string*,   ZVAL_STR, Z_STR_P,
+                         Z_EXPECTED_STRING, parseArgString)
+P3_DECLARE_GCTYPE_DETAIL(IS_ARRAY,    zend_array*,    ZVAL_ARR, Z_ARR_P,
+                         Z_EXPECTED_ARRAY, parseArgArray)
+P3_DECLARE_GCTYPE_DETAIL(IS_OBJECT,   zend_object*,   ZVAL_OBJ, Z_OBJ_P,
+                         Z_EXPECTED_OBJECT, parseArgObject)
+P3_DECLARE_GCTYPE_DETAIL(IS_RESOURCE, zend_resource*, ZVAL_RES, Z_RES_P,
+                         Z_EXPECTED_RESOURCE, parseArgResource)
 #undef P3_DECLARE_GCTYPE_DETAIL
 
 
@@ -218,153 +847,1608 @@ enum NamedType {
   String = IS_STRING, Array = IS_ARRAY,
   Object = IS_OBJECT, Resource = IS_RESOURCE
 };
+} // null namespace
 
-// Borrowed from FOLly https://github.com/facebook/folly
-#define P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, cv_qual) \
-  template <typename TTheClass_, typename RTheReturn_, typename... TTheArgs_> \
-  class classname<TTheClass_, RTheReturn_(TTheArgs_...) cv_qual> { \
-    template < \
-      typename UTheClass_, RTheReturn_ (UTheClass_::*)(TTheArgs_...) cv_qual \
-    > struct sfinae {}; \
-    template <typename UTheClass_> \
-    constexpr static bool test(sfinae<UTheClass_, &UTheClass_::func_name>*) \
-    { return true; } \
-    template <typename> \
-    constexpr static bool test(...) { return false; } \
-  public: \
-    constexpr static bool value = test<TTheClass_>(nullptr); \
+/////////////////////////////////////////////////////////////////////////////
+// Reference handles for refcounted values
+
+// Owns one reference to a zend_string/zend_array/zend_object/zend_resource
+// and releases it on destruction unless ownership is passed on.
+template<typename T>
+class Owned {
+ public:
+  Owned() {}
+  explicit Owned(T *ptr) : m_ptr(ptr) {}
+  Owned(Owned&& that) : m_ptr(that.release()) {}
+  Owned(const Owned&) = delete;
+  ~Owned() { reset(); }
+
+  Owned& operator=(Owned&& that) {
+    reset(that.release());
+    return *this;
   }
-#define P3_CREATE_HAS_MEMBER_FN_TRAITS(classname, func_name) \
-  template <typename, typename> class classname; \
-  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, ); \
-  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, const); \
-  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL( \
-      classname, func_name, /* nolint */ volatile); \
-  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL( \
-      classname, func_name, /* nolint */ volatile const)
+  Owned& operator=(const Owned&) = delete;
 
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToBool, toBool);
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToLong, toLong);
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToDouble, toDouble);
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToString, toString);
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToArray, toArray);
-P3_CREATE_HAS_MEMBER_FN_TRAITS(hasCompare, compare);
+  T* get() const { return m_ptr; }
+  explicit operator bool() const { return m_ptr != nullptr; }
 
-#define P3_CREATE_CAST_WRAPPER(ptype) \
-template<class T> typename \
-  std::enable_if<hasTo##ptype<T, phpType<ptype>::type() const>::value, int>::type \
-castObjectTo##ptype(zval *src, zval *dest) { \
-  phpType<ptype>::make(dest, toObject<T>(src)->to##ptype()); \
-  return SUCCESS; \
-} \
-template<class T> typename \
-  std::enable_if<!hasTo##ptype<T, phpType<ptype>::type() const>::value, int>::type \
-castObjectTo##ptype(zval *src, zval *dest) { return FAILURE; }
+  T* release() {
+    T *ptr = m_ptr;
+    m_ptr = nullptr;
+    return ptr;
+  }
 
-#define P3_CASTABLE_TYPES(X) X(Bool) X(Long) X(Double) X(String) X(Array)
-P3_CASTABLE_TYPES(P3_CREATE_CAST_WRAPPER)
+  void reset(T *ptr = nullptr) {
+    if (m_ptr) {
+      zval tmp;
+      phpType<cppType<T*>::type>::make(&tmp, m_ptr, false);
+      zval_ptr_dtor(&tmp);
+    }
+    m_ptr = ptr;
+  }
 
-template<class T> typename
-  std::enable_if<hasCompare<T, int() const>::value, int>::type \
-compareObjectToNull(zval *ret, T *a) {
-  ZVAL_LONG(ret, a->compare());
-  return SUCCESS;
-}
-template<class T> typename
-  std::enable_if<!hasCompare<T, int() const>::value, int>::type \
-compareObjectToNull(zval *ret, T *a) {
-  return FAILURE;
-}
+ private:
+  T *m_ptr{nullptr};
+};
 
-template<class T> typename
-  std::enable_if<hasCompare<T, int(const T&) const>::value,
-int>::type compareObjectToSimilar(zval *ret, const T *a, const T &b) {
-  ZVAL_LONG(ret, a->compare(b));
-  return SUCCESS;
-}
+// Refers to a value owned elsewhere (e.g. a member of the object).
+// A reference is only added when the value is handed to the engine.
+template<typename T>
+class Borrowed {
+ public:
+  Borrowed() {}
+  explicit Borrowed(T *ptr) : m_ptr(ptr) {}
 
-template<class T> typename
-  std::enable_if<!hasCompare<T, int(const T&) const>::value,
-int>::type compareObjectToSimilar(zval *ret, const T *a, const T &b) {
-  return FAILURE;
-}
+  T* get() const { return m_ptr; }
+  explicit operator bool() const { return m_ptr != nullptr; }
 
-template<class T> typename
-  std::enable_if<hasCompare<T, int(const zval*) const>::value,
-int>::type compareObjectToZval(zval *ret, const T *a, const zval *b) {
-  ZVAL_LONG(ret, a->compare(b));
-  return SUCCESS;
-}
+ private:
+  T *m_ptr{nullptr};
+};
 
-template<class T> typename
-  std::enable_if<!hasCompare<T, int(const zval*) const>::value,
-int>::type compareObjectToZval(zval *ret, const T *a, const zval *b) {
-  return FAILURE;
-}
+/////////////////////////////////////////////////////////////////////////////
+// Copy-on-write payloads (see p3::Shared)
 
-#define P3_CREATE_COMPARE_WRAPPER(ptype) \
-template<class T> typename \
-  std::enable_if<hasCompare<T, int(phpType<ptype>::const_type) const>::value, \
-int>::type compareObjectTo##ptype(zval *ret, const T *a, \
-                                  phpType<ptype>::const_type b) { \
-  ZVAL_LONG(ret, a->compare(b)); \
-  return SUCCESS; \
-} \
-template<class T> typename \
-  std::enable_if<!hasCompare<T, int(phpType<ptype>::const_type) const>::value,\
-int>::type compareObjectTo##ptype(zval *ret, const T *a, \
-                                  phpType<ptype>::const_type b) { \
-  return FAILURE; \
-}
+template<typename P>
+class Shared {
+ public:
+  static_assert(alignof(P) <= ZEND_MM_ALIGNMENT,
+                "Shared payloads may not be over-aligned");
 
-#define P3_COMPARABLE_TYPES(X) P3_CASTABLE_TYPES(X) X(Object) X(Resource)
-P3_COMPARABLE_TYPES(P3_CREATE_COMPARE_WRAPPER)
+  Shared() : m_block(create()) {}
+  Shared(const Shared& that) : m_block(that.m_block) { addRef(); }
+  Shared(Shared&& that) : m_block(that.m_block) { that.m_block = nullptr; }
+  ~Shared() { release(); }
 
-#undef P3_CREATE_COMPARE_WRAPPER
-#undef P3_CREATE_CAST_WRAPPER
-#undef P3_CREATE_HAS_MEMBER_FN_TRAITS
-#undef P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL
-} // null namespace
+  Shared& operator=(const Shared& that) {
+    Shared tmp(that);
+    std::swap(m_block, tmp.m_block);
+    return *this;
+  }
+  Shared& operator=(Shared&& that) {
+    if (this != &that) {
+      release();
+      m_block = that.m_block;
+      that.m_block = nullptr;
+    }
+    return *this;
+  }
 
-/////////////////////////////////////////////////////////////////////////////
+  template<typename... Args>
+  static Shared make(Args&&... args) {
+    return Shared(create(std::forward<Args>(args)...));
+  }
 
-template<class T, typename InitFunc>
-zend_object* allocObject(zend_class_entry *ce, InitFunc init) {
-  T *ptr = reinterpret_cast<T*>(
-    ecalloc(1, sizeof(T) + sizeof(zend_object) +
-               zend_object_properties_size(ce))
-  );
-  init(ptr);
-  auto zobj = toZendObject(ptr);
-  zend_object_std_init(zobj, ce);
-  zobj->handlers = &T::handlers;
-  return zobj;
-}
+  // False once moved from
+  explicit operator bool() const { return m_block != nullptr; }
 
-template<class T> typename
-  std::enable_if<std::is_constructible<T>::value, zend_object*>::type
-createObject(zend_class_entry *ce) {
-  return allocObject<T>(ce, [](T*ptr) { new(ptr) T(); });
-}
+  const P& operator*() const {
+    ZEND_ASSERT(m_block);
+    return m_block->payload;
+  }
+  const P* operator->() const {
+    ZEND_ASSERT(m_block);
+    return &m_block->payload;
+  }
 
-template<class T> typename
-  std::enable_if<std::is_constructible<T,const T&>::value, zend_object*>::type
-cloneObject(zval *oldzval) {
-  const T *old = toObject<T>(oldzval);
-  return allocObject<T>(
-    Z_OBJCE_P(oldzval),
-    [old](T*ptr) { new(ptr) T(*old); }
-  );
-}
+  // Writable payload, separated from any other holders first
+  P& mutate() {
+    ZEND_ASSERT(m_block);
+    if (m_block->refcount > 1) {
+      Block *copy = create(static_cast<const P&>(m_block->payload));
+      release();
+      m_block = copy;
+    }
+    return m_block->payload;
+  }
 
-template<class T>
-void dtorObject(zend_object *obj) {
-  zend_object_std_dtor(obj);
-  toObject<T>(obj)->~T();
-}
+  bool unique() const {
+    ZEND_ASSERT(m_block);
+    return m_block->refcount == 1;
+  }
+  uint32_t useCount() const { return m_block ? m_block->refcount : 0; }
 
-template<class T>
-int castObject(zval *src, zval *dest, int type) {
+ private:
+  struct Block {
+    template<typename... Args>
+    explicit Block(Args&&... args) : payload(std::forward<Args>(args)...) {}
+    uint32_t refcount{1};
+    P payload;
+  };
+
+  explicit Shared(Block *block) : m_block(block) {}
+
+  template<typename... Args>
+  static Block* create(Args&&... args) {
+    return new(emalloc(sizeof(Block))) Block(std::forward<Args>(args)...);
+  }
+
+  void addRef() {
+    if (m_block) {
+      ++m_block->refcount;
+    }
+  }
+
+  void release() {
+    if (m_block && !--m_block->refcount) {
+      m_block->~Block();
+      efree(m_block);
+    }
+    m_block = nullptr;
+  }
+
+  Block *m_block;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Binary serialization (see writeBinary()/readBinary())
+
+// Accumulates the serialized form of an object
+class Buffer {
+ public:
+  Buffer() {}
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+  ~Buffer() { smart_str_free(&m_str); }
+
+  void writeBytes(const void *data, size_t len) {
+    smart_str_appendl(&m_str, reinterpret_cast<const char*>(data), len);
+  }
+  void writeVarint(zend_ulong val) {
+    unsigned char bytes[(sizeof(zend_ulong) * 8 + 6) / 7];
+    size_t len = 0;
+    while (val >= 0x80) {
+      bytes[len++] = (val & 0x7F) | 0x80;
+      val >>= 7;
+    }
+    bytes[len++] = val;
+    writeBytes(bytes, len);
+  }
+  // Zigzag encoded, so that small negative numbers stay short
+  void writeLong(zend_long val) {
+    writeVarint((zend_ulong(val) << 1) ^
+                zend_ulong(val >> (sizeof(zend_long) * 8 - 1)));
+  }
+  void writeDouble(double val) { writeBytes(&val, sizeof(val)); }
+  void writeBool(bool val) { smart_str_appendc(&m_str, val ? 1 : 0); }
+  void writeString(const char *data, size_t len) {
+    writeVarint(len);
+    writeBytes(data, len);
+  }
+  void writeString(const zend_string *str) {
+    writeString(ZSTR_VAL(str), ZSTR_LEN(str));
+  }
+  void writeString(const std::string& str) {
+    writeString(str.data(), str.size());
+  }
+
+  size_t size() const { return m_str.s ? ZSTR_LEN(m_str.s) : 0; }
+
+  // Contents as a new string owned by the caller, leaves the buffer empty
+  zend_string* release() {
+    if (!m_str.s) {
+      return ZSTR_EMPTY_ALLOC();
+    }
+    smart_str_0(&m_str);
+    zend_string *ret = m_str.s;
+    m_str.s = nullptr;
+    m_str.a = 0;
+    return ret;
+  }
+
+ private:
+  smart_str m_str{nullptr, 0};
+};
+
+// Reads back what Buffer wrote, every read fails once the data runs out
+class View {
+ public:
+  View(const unsigned char *data, size_t len)
+    : m_pos(data), m_end(data + len) {}
+
+  size_t remaining() const { return m_end - m_pos; }
+  bool empty() const { return m_pos == m_end; }
+
+  bool readBytes(void *data, size_t len) {
+    if (len > remaining()) { return false; }
+    memcpy(data, m_pos, len);
+    m_pos += len;
+    return true;
+  }
+  bool readVarint(zend_ulong& val) {
+    val = 0;
+    for (size_t shift = 0; shift < (sizeof(zend_ulong) * 8); shift += 7) {
+      if (m_pos == m_end) { return false; }
+      const unsigned char byte = *m_pos++;
+      val |= zend_ulong(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) { return true; }
+    }
+    return false;
+  }
+  bool readLong(zend_long& val) {
+    zend_ulong raw;
+    if (!readVarint(raw)) { return false; }
+    val = zend_long(raw >> 1) ^ -zend_long(raw & 1);
+    return true;
+  }
+  bool readDouble(double& val) { return readBytes(&val, sizeof(val)); }
+  bool readBool(bool& val) {
+    unsigned char byte;
+    if (!readBytes(&byte, 1) || (byte > 1)) { return false; }
+    val = byte;
+    return true;
+  }
+  // Points into the serialized data, nothing is copied
+  bool readString(const char*& data, size_t& len) {
+    zend_ulong n;
+    if (!readVarint(n) || (n > remaining())) { return false; }
+    data = reinterpret_cast<const char*>(m_pos);
+    len = n;
+    m_pos += n;
+    return true;
+  }
+  bool readString(std::string& str) {
+    const char *data;
+    size_t len;
+    if (!readString(data, len)) { return false; }
+    str.assign(data, len);
+    return true;
+  }
+  // New string owned by the caller
+  bool readString(zend_string*& str) {
+    const char *data;
+    size_t len;
+    if (!readString(data, len)) { return false; }
+    str = zend_string_init(data, len, 0);
+    return true;
+  }
+
+ private:
+  const unsigned char *m_pos;
+  const unsigned char *m_end;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// JSON encoding (see writeJson())
+
+namespace {
+// Escape character following the backslash, 'u' for \u00XX, 0 for none
+constexpr char jsonEscapeChar(unsigned char c) {
+  return (c == '"') ? '"' : (c == '\\') ? '\\' :
+         (c == '\b') ? 'b' : (c == '\f') ? 'f' : (c == '\n') ? 'n' :
+         (c == '\r') ? 'r' : (c == '\t') ? 't' : (c < 0x20) ? 'u' : 0;
+}
+
+// Length of the leading run which needs no escaping
+inline size_t jsonPlainPrefix(const char *str, size_t len) {
+  size_t i = 0;
+#ifdef P3_JSON_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  for (; (i + 16) <= len; i += 16) {
+    const __m128i chunk =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+    const __m128i special = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                   _mm_cmpeq_epi8(chunk, backslash)),
+      // Unsigned chunk <= 0x1F
+      _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    const int mask = _mm_movemask_epi8(special);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; ++i) {
+    if (jsonEscapeChar(str[i])) { break; }
+  }
+  return i;
+}
+} // null namespace
+
+// Appends JSON text to a smart_str, placing separators automatically
+class JsonWriter {
+ public:
+  explicit JsonWriter(smart_str& buf) : m_buf(buf) {}
+  JsonWriter(const JsonWriter&) = delete;
+  JsonWriter& operator=(const JsonWriter&) = delete;
+
+  void beginObject() { open('{'); }
+  void endObject() { close('}'); }
+  void beginArray() { open('['); }
+  void endArray() { close(']'); }
+
+  void key(const char *name, size_t len) {
+    separate();
+    writeString(name, len);
+    smart_str_appendc(&m_buf, ':');
+    m_separate = false;
+  }
+  void key(const char *name) { key(name, strlen(name)); }
+  void key(const zend_string *name) {
+    key(ZSTR_VAL(name), ZSTR_LEN(name));
+  }
+
+  void nullValue() { raw("null", 4); }
+  void value(bool val) { val ? raw("true", 4) : raw("false", 5); }
+  void value(zend_long val) {
+    writeInteger((val < 0) ? (zend_ulong(0) - zend_ulong(val))
+                           : zend_ulong(val), val < 0);
+  }
+  // Any other integral type (int, size_t, ...)
+  template<typename I> typename std::enable_if<std::is_integral<I>::value &&
+    !std::is_same<I, bool>::value && !std::is_same<I, zend_long>::value>::type
+  value(I val) {
+    writeInteger((val < 0) ? (zend_ulong(0) - zend_ulong(val))
+                           : zend_ulong(val), val < 0);
+  }
+  void value(double val);
+  void value(const char *str, size_t len) {
+    separate();
+    writeString(str, len);
+  }
+  void value(const char *str) { value(str, strlen(str)); }
+  void value(const zend_string *str) { value(ZSTR_VAL(str), ZSTR_LEN(str)); }
+  void value(const std::string& str) { value(str.data(), str.size()); }
+  // Nested object with its own writeJson()
+  template<class T>
+  auto value(const T& obj) -> decltype(obj.writeJson(*this)) {
+    return obj.writeJson(*this);
+  }
+
+  // Pre-encoded JSON
+  void raw(const char *json, size_t len) {
+    separate();
+    smart_str_appendl(&m_buf, json, len);
+  }
+
+  // False once a value which JSON cannot represent (Inf/NaN) was written
+  bool valid() const { return m_valid; }
+
+ private:
+  void separate() {
+    if (m_separate) {
+      smart_str_appendc(&m_buf, ',');
+    }
+    m_separate = true;
+  }
+  void open(char c) {
+    separate();
+    smart_str_appendc(&m_buf, c);
+    m_separate = false;
+  }
+  void close(char c) {
+    smart_str_appendc(&m_buf, c);
+    m_separate = true;
+  }
+  void writeInteger(zend_ulong n, bool negative);
+  void writeString(const char *str, size_t len);
+
+  smart_str& m_buf;
+  bool m_separate{false};
+  bool m_valid{true};
+};
+
+inline void JsonWriter::writeInteger(zend_ulong n, bool negative) {
+  // Two digits at a time, right to left
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  char *pos = end;
+  while (n >= 100) {
+    const size_t idx = (n % 100) * 2;
+    n /= 100;
+    *--pos = pairs[idx + 1];
+    *--pos = pairs[idx];
+  }
+  if (n >= 10) {
+    *--pos = pairs[n * 2 + 1];
+    *--pos = pairs[n * 2];
+  } else {
+    *--pos = '0' + n;
+  }
+  if (negative) {
+    *--pos = '-';
+  }
+  raw(pos, end - pos);
+}
+
+inline void JsonWriter::value(double val) {
+  if (!zend_finite(val) || (val != val)) {
+    m_valid = false;
+    raw("0", 1);
+    return;
+  }
+  // Shortest digits which round trip, laid out as PHP would with
+  // serialize_precision = -1
+  int decpt, sign;
+  char *end;
+  char *digits = zend_dtoa(val, 0, 0, &decpt, &sign, &end);
+  const int ndigits = end - digits;
+  char buf[32];
+  char *pos = buf;
+  if (sign) {
+    // Including -0, as json_encode() writes it
+    *pos++ = '-';
+  }
+  if ((decpt <= -4) || (decpt > 17)) {
+    const int exp = decpt - 1;
+    *pos++ = digits[0];
+    *pos++ = '.';
+    if (ndigits > 1) {
+      memcpy(pos, digits + 1, ndigits - 1);
+      pos += ndigits - 1;
+    } else {
+      *pos++ = '0';
+    }
+    pos += snprintf(pos, buf + sizeof(buf) - pos, "e%c%d",
+                    (exp < 0) ? '-' : '+', (exp < 0) ? -exp : exp);
+  } else if (decpt <= 0) {
+    *pos++ = '0';
+    *pos++ = '.';
+    memset(pos, '0', -decpt);
+    pos += -decpt;
+    memcpy(pos, digits, ndigits);
+    pos += ndigits;
+  } else if (decpt >= ndigits) {
+    memcpy(pos, digits, ndigits);
+    pos += ndigits;
+    memset(pos, '0', decpt - ndigits);
+    pos += decpt - ndigits;
+  } else {
+    memcpy(pos, digits, decpt);
+    pos += decpt;
+    *pos++ = '.';
+    memcpy(pos, digits + decpt, ndigits - decpt);
+    pos += ndigits - decpt;
+  }
+  zend_freedtoa(digits);
+  raw(buf, pos - buf);
+}
+
+inline void JsonWriter::writeString(const char *str, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  smart_str_appendc(&m_buf, '"');
+  for (;;) {
+    const size_t plain = jsonPlainPrefix(str, len);
+    smart_str_appendl(&m_buf, str, plain);
+    if (plain == len) { break; }
+    const unsigned char c = str[plain];
+    const char esc = jsonEscapeChar(c);
+    if (esc == 'u') {
+      const char seq[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+      smart_str_appendl(&m_buf, seq, sizeof(seq));
+    } else {
+      const char seq[] = { '\\', esc };
+      smart_str_appendl(&m_buf, seq, sizeof(seq));
+    }
+    str += plain + 1;
+    len -= plain + 1;
+  }
+  smart_str_appendc(&m_buf, '"');
+}
+
+namespace {
+// Move a C++ value into a zval with the reference count it needs
+template<typename R> struct returnValue {
+  static void set(zval *pzv, R val) {
+    phpType<cppType<R>::type>::make(pzv, val);
+  }
+};
+template<typename T> struct returnValue<T*> {
+  static void set(zval *pzv, T *val) {
+    if (!val) {
+      ZVAL_NULL(pzv);
+      return;
+    }
+    // Ownership of the returned reference passes to pzv
+    phpType<cppType<T*>::type>::make(pzv, val, false);
+  }
+};
+// A const pointer can't have been handed over, so treat it as borrowed
+template<typename T> struct returnValue<const T*> {
+  static void set(zval *pzv, const T *val) {
+    if (!val) {
+      ZVAL_NULL(pzv);
+      return;
+    }
+    phpType<cppType<T*>::type>::make(pzv, const_cast<T*>(val), true);
+  }
+};
+template<typename T> struct returnValue<Owned<T>> {
+  static void set(zval *pzv, Owned<T> val) {
+    returnValue<T*>::set(pzv, val.release());
+  }
+};
+template<typename T> struct returnValue<Borrowed<T>> {
+  static void set(zval *pzv, Borrowed<T> val) {
+    if (!val) {
+      ZVAL_NULL(pzv);
+      return;
+    }
+    phpType<cppType<T*>::type>::make(pzv, val.get(), true);
+  }
+};
+template<> struct returnValue<std::string> {
+  static void set(zval *pzv, const std::string& val) {
+    ZVAL_STRINGL(pzv, val.data(), val.size());
+  }
+};
+
+// Borrowed from FOLly https://github.com/facebook/folly
+#define P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, cv_qual) \
+  template <typename TTheClass_, typename RTheReturn_, typename... TTheArgs_> \
+  class classname<TTheClass_, RTheReturn_(TTheArgs_...) cv_qual> { \
+    template <typename UTheClass_> \
+    using member = RTheReturn_ (UTheClass_::*)(TTheArgs_...) cv_qual; \
+    /* static_cast also accepts members inherited from a base class */ \
+    template <typename UTheClass_> \
+    constexpr static bool test(decltype(static_cast<member<UTheClass_>>( \
+      &UTheClass_::func_name))*) \
+    { return true; } \
+    template <typename> \
+    constexpr static bool test(...) { return false; } \
+  public: \
+    constexpr static bool value = test<TTheClass_>(nullptr); \
+  }
+#define P3_CREATE_HAS_MEMBER_FN_TRAITS(classname, func_name) \
+  template <typename, typename> class classname; \
+  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, ); \
+  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL(classname, func_name, const); \
+  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL( \
+      classname, func_name, /* nolint */ volatile); \
+  P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL( \
+      classname, func_name, /* nolint */ volatile const)
+
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToBool, toBool);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToLong, toLong);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToDouble, toDouble);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToString, toString);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasToArray, toArray);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasCompare, compare);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasAt, at);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasSubscript, operator[]);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasContains, contains);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasErase, erase);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasBegin, begin);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasEnd, end);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasSize, size);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasCount, count);
+P3_CREATE_HAS_MEMBER_FN_TRAITS(hasReset, reset);
+
+#define P3_BINARY_OPERATORS(X) \
+  X(ZEND_ADD, opAdd, hasOperatorAdd, +) \
+  X(ZEND_SUB, opSub, hasOperatorSub, -) \
+  X(ZEND_MUL, opMul, hasOperatorMul, *) \
+  X(ZEND_DIV, opDiv, hasOperatorDiv, /) \
+  X(ZEND_MOD, opMod, hasOperatorMod, %) \
+  X(ZEND_SL, opShl, hasOperatorShl, <<) \
+  X(ZEND_SR, opShr, hasOperatorShr, >>) \
+  X(ZEND_BW_AND, opAnd, hasOperatorAnd, &) \
+  X(ZEND_BW_OR, opOr, hasOperatorOr, |) \
+  X(ZEND_BW_XOR, opXor, hasOperatorXor, ^)
+#define P3_CREATE_HAS_OPERATOR_TRAITS(opcode, name, trait, op) \
+P3_CREATE_HAS_MEMBER_FN_TRAITS(trait, operator op);
+P3_BINARY_OPERATORS(P3_CREATE_HAS_OPERATOR_TRAITS)
+#undef P3_CREATE_HAS_OPERATOR_TRAITS
+
+template<typename...> struct voidType { typedef void type; };
+
+// Container accessors taking a key of type K, with any return type
+#define P3_CREATE_DIM_ACCESSOR(name, trait, func, cv) \
+template<class T, typename K, typename = void> \
+struct name { static constexpr bool value = false; }; \
+template<class T, typename K> \
+struct name<T, K, typename voidType<decltype( \
+    std::declval<cv T&>().func(std::declval<K>()))>::type> { \
+  typedef decltype(std::declval<cv T&>().func(std::declval<K>())) result; \
+  static constexpr bool value = trait<T, result(K) cv>::value; \
+};
+P3_CREATE_DIM_ACCESSOR(dimAt, hasAt, at, const)
+P3_CREATE_DIM_ACCESSOR(dimGet, hasSubscript, operator[], const)
+P3_CREATE_DIM_ACCESSOR(dimSet, hasSubscript, operator[], )
+P3_CREATE_DIM_ACCESSOR(dimContains, hasContains, contains, const)
+P3_CREATE_DIM_ACCESSOR(dimErase, hasErase, erase, )
+#undef P3_CREATE_DIM_ACCESSOR
+
+// Binary operators taking an operand of type A, with any return type
+#define P3_CREATE_BINARY_OPERATOR(opcode, name, trait, op) \
+template<class T, typename A, typename = void> \
+struct name { static constexpr bool value = false; }; \
+template<class T, typename A> \
+struct name<T, A, typename voidType<decltype( \
+    std::declval<const T&>().operator op(std::declval<A>()))>::type> { \
+  typedef decltype( \
+    std::declval<const T&>().operator op(std::declval<A>())) result; \
+  static constexpr bool value = trait<T, result(A) const>::value; \
+  static result apply(const T& a, A b) { return a.operator op(b); } \
+};
+P3_BINARY_OPERATORS(P3_CREATE_BINARY_OPERATOR)
+#undef P3_CREATE_BINARY_OPERATOR
+
+template<class T, template<class, typename, typename = void> class Op>
+struct anyOperand {
+  static constexpr bool value =
+    Op<T, const T&>::value || Op<T, zend_long>::value ||
+    Op<T, double>::value || Op<T, const zend_string*>::value;
+};
+
+template<class T>
+struct hasOperators {
+#define P3_ANY_OPERAND(opcode, name, trait, op) anyOperand<T, name>::value ||
+  static constexpr bool value = P3_BINARY_OPERATORS(P3_ANY_OPERAND) false;
+#undef P3_ANY_OPERAND
+};
+
+// Iteration needs matching begin() const and end() const
+template<class T, typename = void>
+struct isIterable { static constexpr bool value = false; };
+template<class T>
+struct isIterable<T, typename voidType<
+    decltype(std::declval<const T&>().begin()),
+    decltype(std::declval<const T&>().end())>::type> {
+  typedef decltype(std::declval<const T&>().begin()) iterator;
+  static constexpr bool value = hasBegin<T, iterator() const>::value &&
+                                hasEnd<T, iterator() const>::value;
+};
+
+// Element count from N size() const, or N count() const
+#define P3_CREATE_SIZE_ACCESSOR(name, trait, func) \
+template<class T, typename = void> \
+struct name { static constexpr bool value = false; }; \
+template<class T> \
+struct name<T, typename voidType< \
+    decltype(std::declval<const T&>().func())>::type> { \
+  typedef decltype(std::declval<const T&>().func()) result; \
+  static constexpr bool value = std::is_integral<result>::value && \
+                                trait<T, result() const>::value; \
+  static zend_long get(const T& obj) { return obj.func(); } \
+};
+P3_CREATE_SIZE_ACCESSOR(sizeAccessor, hasSize, size)
+P3_CREATE_SIZE_ACCESSOR(countAccessor, hasCount, count)
+#undef P3_CREATE_SIZE_ACCESSOR
+
+// Writes need operator[] to return a mutable reference
+template<class T, typename K, bool = dimSet<T, K>::value>
+struct dimAssignable { static constexpr bool value = false; };
+template<class T, typename K>
+struct dimAssignable<T, K, true> {
+  typedef typename dimSet<T, K>::result result;
+  static constexpr bool value = std::is_lvalue_reference<result>::value &&
+    !std::is_const<typename std::remove_reference<result>::type>::value;
+};
+
+template<class T, typename K>
+struct dimOps {
+  static constexpr bool readable = dimAt<T, K>::value || dimGet<T, K>::value;
+  static constexpr bool writable = dimAssignable<T, K>::value;
+  static constexpr bool checkable = dimContains<T, K>::value;
+  static constexpr bool erasable = dimErase<T, K>::value;
+  static constexpr bool any = readable || writable || checkable || erasable;
+};
+
+#define P3_CREATE_CAST_WRAPPER(ptype) \
+template<class T> typename \
+  std::enable_if<hasTo##ptype<T, phpType<ptype>::type() const>::value, int>::type \
+castObjectTo##ptype(zval *src, zval *dest) { \
+  returnValue<phpType<ptype>::type>::set(dest, toObject<T>(src)->to##ptype()); \
+  return SUCCESS; \
+} \
+template<class T> typename \
+  std::enable_if<!hasTo##ptype<T, phpType<ptype>::type() const>::value, int>::type \
+castObjectTo##ptype(zval *src, zval *dest) { return FAILURE; }
+
+#define P3_CASTABLE_TYPES(X) X(Bool) X(Long) X(Double) X(String) X(Array)
+P3_CASTABLE_TYPES(P3_CREATE_CAST_WRAPPER)
+
+template<class T> typename
+  std::enable_if<hasCompare<T, int() const>::value, int>::type \
+compareObjectToNull(zval *ret, T *a) {
+  ZVAL_LONG(ret, a->compare());
+  return SUCCESS;
+}
+template<class T> typename
+  std::enable_if<!hasCompare<T, int() const>::value, int>::type \
+compareObjectToNull(zval *ret, T *a) {
+  return FAILURE;
+}
+
+// Matched by expression, so that compare(const Base&) serves derived classes
+template<class T, typename = void>
+struct comparesSimilar { static constexpr bool value = false; };
+template<class T>
+struct comparesSimilar<T, typename voidType<decltype(
+    std::declval<const T&>().compare(std::declval<const T&>()))>::type> {
+  static constexpr bool value = std::is_convertible<decltype(
+    std::declval<const T&>().compare(std::declval<const T&>())), int>::value;
+};
+
+template<class T> typename
+  std::enable_if<comparesSimilar<T>::value,
+int>::type compareObjectToSimilar(zval *ret, const T *a, const T &b) {
+  ZVAL_LONG(ret, a->compare(b));
+  return SUCCESS;
+}
+
+template<class T> typename
+  std::enable_if<!comparesSimilar<T>::value,
+int>::type compareObjectToSimilar(zval *ret, const T *a, const T &b) {
+  return FAILURE;
+}
+
+template<class T> typename
+  std::enable_if<hasCompare<T, int(const zval*) const>::value,
+int>::type compareObjectToZval(zval *ret, const T *a, const zval *b) {
+  ZVAL_LONG(ret, a->compare(b));
+  return SUCCESS;
+}
+
+template<class T> typename
+  std::enable_if<!hasCompare<T, int(const zval*) const>::value,
+int>::type compareObjectToZval(zval *ret, const T *a, const zval *b) {
+  return FAILURE;
+}
+
+#define P3_CREATE_COMPARE_WRAPPER(ptype) \
+template<class T> typename \
+  std::enable_if<hasCompare<T, int(phpType<ptype>::const_type) const>::value, \
+int>::type compareObjectTo##ptype(zval *ret, const T *a, \
+                                  phpType<ptype>::const_type b) { \
+  ZVAL_LONG(ret, a->compare(b)); \
+  return SUCCESS; \
+} \
+template<class T> typename \
+  std::enable_if<!hasCompare<T, int(phpType<ptype>::const_type) const>::value,\
+int>::type compareObjectTo##ptype(zval *ret, const T *a, \
+                                  phpType<ptype>::const_type b) { \
+  return FAILURE; \
+}
+
+#define P3_COMPARABLE_TYPES(X) P3_CASTABLE_TYPES(X) X(Object) X(Resource)
+P3_COMPARABLE_TYPES(P3_CREATE_COMPARE_WRAPPER)
+
+#undef P3_CREATE_COMPARE_WRAPPER
+#undef P3_CREATE_CAST_WRAPPER
+#undef P3_CREATE_HAS_MEMBER_FN_TRAITS
+#undef P3_CREATE_HAS_MEMBER_FN_TRAITS_IMPL
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// C++ exception translation (see mapException())
+
+typedef bool (*exceptionMatcher)(zend_class_entry *ce);
+
+struct ExceptionMapping {
+  exceptionMatcher match;
+  zend_class_entry *ce;
+};
+
+// Shared by every translation unit, populated from MINIT
+inline std::vector<ExceptionMapping>& exceptionMappings() {
+  static std::vector<ExceptionMapping> mappings;
+  return mappings;
+}
+
+namespace {
+template<class E> typename
+  std::enable_if<std::is_base_of<std::exception, E>::value, const char*>::type
+exceptionMessage(const E& e) { return e.what(); }
+
+template<class E> typename
+  std::enable_if<!std::is_base_of<std::exception, E>::value, const char*>::type
+exceptionMessage(const E& e) { return ""; }
+} // null namespace
+
+#ifdef P3_EXCEPTIONS
+// Must be called while an exception is being handled
+template<class E>
+bool matchException(zend_class_entry *ce) {
+  try {
+    throw;
+  } catch (const E& e) {
+    zend_throw_exception(ce, exceptionMessage(e), 0);
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+// Rethrow the exception being handled as a PHP exception
+inline void translateException() {
+  const auto& mappings = exceptionMappings();
+  for (auto it = mappings.rbegin(); it != mappings.rend(); ++it) {
+    if (it->match(it->ce)) {
+      return;
+    }
+  }
+  try {
+    throw;
+  } catch (const std::bad_alloc&) {
+    zend_throw_error(nullptr, "Out of memory");
+  } catch (const std::exception& e) {
+    zend_throw_exception(zend_ce_exception, e.what(), 0);
+  } catch (...) {
+    zend_throw_error(nullptr, "Unknown C++ exception");
+  }
+}
+
+template<typename Func>
+void callTranslated(Func&& func) {
+  try {
+    func();
+  } catch (...) {
+    translateException();
+  }
+}
+
+// As above, evaluating to `failed' when an exception was translated
+template<typename R, typename Func>
+R callTranslated(R failed, Func&& func) {
+  try {
+    return func();
+  } catch (...) {
+    translateException();
+    return failed;
+  }
+}
+#else
+template<class E>
+bool matchException(zend_class_entry *ce) { return false; }
+
+template<typename Func>
+void callTranslated(Func&& func) {
+  func();
+}
+
+template<typename R, typename Func>
+R callTranslated(R failed, Func&& func) {
+  return func();
+}
+#endif
+
+template<class E>
+void mapException(zend_class_entry *ce) {
+  exceptionMappings().push_back({ matchException<E>, ce });
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Native method binding (see P3_ME_NATIVE)
+
+namespace {
+template<std::size_t...> struct indexSequence {};
+template<std::size_t N, std::size_t... I>
+struct makeIndexSequence : makeIndexSequence<N - 1, N - 1, I...> {};
+template<std::size_t... I>
+struct makeIndexSequence<0, I...> { typedef indexSequence<I...> type; };
+
+// Unpack a single argument using the type map above
+template<typename P>
+struct nativeArg {
+  typedef phpType<cppType<P>::type> php;
+  typedef typename php::type type;
+  static bool parse(uint32_t num, zval *arg, type &val) {
+    if (EXPECTED(php::parse(arg, val))) {
+      return true;
+    }
+#if PHP_VERSION_ID >= 70300
+    zend_wrong_parameter_type_error(num, php::expected, arg);
+#else
+    zend_wrong_parameter_type_error(0, num, php::expected, arg);
+#endif
+    return false;
+  }
+};
+template<> struct nativeArg<zval*> {
+  typedef zval* type;
+  static bool parse(uint32_t num, zval *arg, type &val) {
+    val = arg;
+    return true;
+  }
+};
+template<> struct nativeArg<const zval*> : nativeArg<zval*> {};
+
+template<typename R> struct nativeReturn {
+  template<typename Func, typename... A>
+  static void call(zval *return_value, const Func& func, A&... args) {
+    returnValue<R>::set(return_value, func(args...));
+  }
+};
+template<> struct nativeReturn<void> {
+  template<typename Func, typename... A>
+  static void call(zval *return_value, const Func& func, A&... args) {
+    func(args...);
+  }
+};
+
+// A constructor must not leave a half built object behind on bad
+// arguments, so its parameter errors are thrown as TypeError
+// (as zend_parse_parameters_throw() would) rather than warned about.
+struct ctorErrorHandling {
+  bool ctor;
+  zend_error_handling saved;
+  explicit ctorErrorHandling(zend_execute_data *execute_data)
+      : ctor(EX(func)->common.fn_flags & ZEND_ACC_CTOR) {
+    if (ctor) {
+      zend_replace_error_handling(EH_THROW, zend_ce_type_error, &saved);
+    }
+  }
+  ~ctorErrorHandling() {
+    if (ctor) {
+      zend_restore_error_handling(&saved);
+    }
+  }
+};
+
+template<typename... Args, typename Tuple, std::size_t... I>
+bool parseNative(zend_execute_data *execute_data, Tuple& args,
+                 indexSequence<I...>) {
+  constexpr uint32_t num_args = sizeof...(Args);
+  ctorErrorHandling eh(execute_data);
+  if (UNEXPECTED(ZEND_NUM_ARGS() != num_args)) {
+#if PHP_VERSION_ID >= 70300
+    zend_wrong_parameters_count_error(num_args, num_args);
+#else
+    zend_wrong_parameters_count_error(0, ZEND_NUM_ARGS(), num_args, num_args);
+#endif
+    return false;
+  }
+
+  bool ok = true;
+  int unpack[] = { 0, (ok = ok &&
+    nativeArg<typename std::decay<Args>::type>::parse(
+      I + 1, ZEND_CALL_ARG(execute_data, I + 1), std::get<I>(args)), 0)... };
+  (void)unpack;
+  return ok;
+}
+
+template<typename R, typename... Args, typename Func, std::size_t... I>
+void callNative(INTERNAL_FUNCTION_PARAMETERS,
+                const Func& func, indexSequence<I...> seq) {
+  std::tuple<typename nativeArg<typename std::decay<Args>::type>::type...>
+    args;
+  if (UNEXPECTED(!parseNative<Args...>(execute_data, args, seq))) {
+    return;
+  }
+  nativeReturn<typename std::decay<R>::type>::call(
+    return_value, func, std::get<I>(args)...);
+}
+
+template<class T, typename M, M meth, typename R>
+struct boundMethod {
+  T *obj;
+  template<typename... A>
+  R operator()(A&... args) const { return (obj->*meth)(args...); }
+};
+
+template<typename M, M meth> struct nativeMethod;
+
+template<class T, typename R, typename... Args, R (T::*meth)(Args...)>
+struct nativeMethod<R (T::*)(Args...), meth> {
+  static void invoke(INTERNAL_FUNCTION_PARAMETERS) {
+    callTranslated([&] {
+      boundMethod<T, R (T::*)(Args...), meth, R>
+        func{ thisObject<T>(getThis()) };
+      if (!func.obj) { return; }
+      callNative<R, Args...>(INTERNAL_FUNCTION_PARAM_PASSTHRU, func,
+        typename makeIndexSequence<sizeof...(Args)>::type());
+    });
+  }
+};
+
+template<class T, typename R, typename... Args, R (T::*meth)(Args...) const>
+struct nativeMethod<R (T::*)(Args...) const, meth> {
+  static void invoke(INTERNAL_FUNCTION_PARAMETERS) {
+    callTranslated([&] {
+      boundMethod<const T, R (T::*)(Args...) const, meth, R>
+        func{ thisObject<T>(getThis()) };
+      if (!func.obj) { return; }
+      callNative<R, Args...>(INTERNAL_FUNCTION_PARAM_PASSTHRU, func,
+        typename makeIndexSequence<sizeof...(Args)>::type());
+    });
+  }
+};
+
+template<typename R, typename... Args, R (*meth)(Args...)>
+struct nativeMethod<R (*)(Args...), meth> {
+  static void invoke(INTERNAL_FUNCTION_PARAMETERS) {
+    callTranslated([&] {
+      callNative<R, Args...>(INTERNAL_FUNCTION_PARAM_PASSTHRU, meth,
+        typename makeIndexSequence<sizeof...(Args)>::type());
+    });
+  }
+};
+
+// Arginfo types for native parameters and return values
+template<typename P> struct nativeArgType {
+  static constexpr zend_uchar code = cppType<P>::type;
+  static constexpr bool allow_null = false;
+};
+template<> struct nativeArgType<zval*> {
+  static constexpr zend_uchar code = 0;
+  static constexpr bool allow_null = true;
+};
+template<> struct nativeArgType<const zval*> : nativeArgType<zval*> {};
+
+template<typename R> struct nativeReturnType {
+  static constexpr zend_uchar code = cppType<R>::type;
+  static constexpr bool allow_null = std::is_pointer<R>::value;
+};
+template<typename T> struct nativeReturnType<Owned<T>> {
+  static constexpr zend_uchar code = cppType<T*>::type;
+  static constexpr bool allow_null = true;
+};
+template<typename T> struct nativeReturnType<Borrowed<T>> :
+  nativeReturnType<Owned<T>> {};
+template<> struct nativeReturnType<std::string> {
+  static constexpr zend_uchar code = IS_STRING;
+  static constexpr bool allow_null = false;
+};
+template<> struct nativeReturnType<void> {
+  static constexpr zend_uchar code = IS_VOID;
+  static constexpr bool allow_null = false;
+};
+// Constructors may not declare a return type, not even void
+struct noReturnType {};
+template<> struct nativeReturnType<noReturnType> {
+  static constexpr zend_uchar code = 0;
+  static constexpr bool allow_null = false;
+};
+
+constexpr const char *nativeArgNames[] = {
+  "arg1", "arg2", "arg3", "arg4", "arg5", "arg6",
+  "arg7", "arg8", "arg9", "arg10", "arg11", "arg12",
+};
+
+template<typename R, typename Seq, typename... Args> struct argInfoTable;
+template<typename R, std::size_t... I, typename... Args>
+struct argInfoTable<R, indexSequence<I...>, Args...> {
+  static_assert(sizeof...(Args) <=
+                sizeof(nativeArgNames) / sizeof(nativeArgNames[0]),
+                "Too many parameters for generated arginfo");
+  static const zend_internal_arg_info info[sizeof...(Args) + 1];
+};
+template<typename R, std::size_t... I, typename... Args>
+const zend_internal_arg_info
+argInfoTable<R, indexSequence<I...>, Args...>::info[sizeof...(Args) + 1] = {
+  { (const char*)(zend_uintptr_t)(sizeof...(Args)),
+    ZEND_TYPE_ENCODE(nativeReturnType<R>::code,
+                     nativeReturnType<R>::allow_null), 0, 0 },
+  { nativeArgNames[I],
+    ZEND_TYPE_ENCODE(nativeArgType<Args>::code,
+                     nativeArgType<Args>::allow_null), 0, 0 }...
+};
+
+template<typename M> struct nativeArgInfo;
+template<class T, typename R, typename... Args>
+struct nativeArgInfo<R (T::*)(Args...)> : argInfoTable<
+  typename std::decay<R>::type,
+  typename makeIndexSequence<sizeof...(Args)>::type,
+  typename std::decay<Args>::type...> {};
+template<class T, typename R, typename... Args>
+struct nativeArgInfo<R (T::*)(Args...) const> :
+  nativeArgInfo<R (T::*)(Args...)> {};
+template<typename R, typename... Args>
+struct nativeArgInfo<R (*)(Args...)> : argInfoTable<
+  typename std::decay<R>::type,
+  typename makeIndexSequence<sizeof...(Args)>::type,
+  typename std::decay<Args>::type...> {};
+
+template<typename M> struct nativeCtorArgInfo;
+template<class T, typename R, typename... Args>
+struct nativeCtorArgInfo<R (T::*)(Args...)> : argInfoTable<
+  noReturnType,
+  typename makeIndexSequence<sizeof...(Args)>::type,
+  typename std::decay<Args>::type...> {
+  static_assert(std::is_void<R>::value, "Constructors must return void");
+};
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// Object allocation policies (see object_allocator)
+
+struct ZeroedAllocator {
+  template<class T>
+  static void* alloc(zend_class_entry *ce, size_t extra) {
+    return ecalloc(1, objectLayout<T>::size(ce, extra));
+  }
+};
+
+struct BinAllocator {
+  template<class T>
+  static void* alloc(zend_class_entry *ce, size_t extra) {
+    typedef objectLayout<T> layout;
+    const size_t props = zend_object_properties_size(ce) + sizeof(zval);
+    char *ptr = reinterpret_cast<char*>(
+      EXPECTED((props == 0) && (extra == 0))
+        ? emalloc(layout::base_size) : emalloc(layout::size(ce, extra)));
+    // Only the engine's part needs zeroing, T is initialized by init()
+    memset(ptr + layout::offset, 0, layout::propertiesEnd(ce) - layout::offset);
+    return ptr;
+  }
+};
+
+namespace {
+template<class T>
+class objectAllocator {
+  template<class U>
+  static typename U::object_allocator test(typename U::object_allocator*);
+  template<class U>
+  static ZeroedAllocator test(...);
+ public:
+  typedef decltype(test<T>(nullptr)) type;
+};
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// Request scoped arena (see ArenaAllocator)
+
+class RequestArena {
+ public:
+  static constexpr size_t chunkSize = 32 * 1024;
+
+  static RequestArena& instance() {
+#ifdef ZTS
+    static thread_local RequestArena arena;
+#else
+    static RequestArena arena;
+#endif
+    return arena;
+  }
+
+  RequestArena() {}
+  RequestArena(const RequestArena&) = delete;
+  RequestArena& operator=(const RequestArena&) = delete;
+  // Runs at process (or thread) exit, after the memory manager has shut
+  // down and taken any chunks not release()d with it, so nothing is freed
+  ~RequestArena() {}
+
+  void* allocate(size_t size, size_t alignment) {
+    char *ptr = reinterpret_cast<char*>(
+      alignUp(reinterpret_cast<zend_uintptr_t>(m_pos), alignment));
+    if (UNEXPECTED(!m_pos || (size > size_t(m_end - ptr)))) {
+      return allocateSlow(size, alignment);
+    }
+    m_pos = ptr + size;
+    m_used += size;
+    return ptr;
+  }
+
+  // Bytes are only reclaimed from the most recent allocation
+  void deallocate(void *ptr, size_t size) {
+    if (reinterpret_cast<char*>(ptr) + size == m_pos) {
+      m_pos = reinterpret_cast<char*>(ptr);
+      m_used -= size;
+    }
+  }
+
+  template<class Owner>
+  void* allocate(size_t size, size_t alignment) {
+    auto& counter = usageCounter<Owner>();
+    if (counter.generation != m_generation) {
+      counter.generation = m_generation;
+      counter.bytes = 0;
+    }
+    counter.bytes += size;
+    return allocate(size, alignment);
+  }
+
+  // Bytes allocated this request, in total or on behalf of Owner
+  size_t used() const { return m_used; }
+  template<class Owner>
+  static size_t usage() {
+    const auto& counter = usageCounter<Owner>();
+    return (counter.generation == instance().m_generation)
+      ? counter.bytes : 0;
+  }
+
+  // Free every chunk, invalidating everything allocated from the arena
+  void release() {
+    while (m_chunks) {
+      Chunk *next = m_chunks->next;
+      efree(m_chunks);
+      m_chunks = next;
+    }
+    m_pos = m_end = nullptr;
+    m_used = 0;
+    ++m_generation;
+  }
+
+ private:
+  struct Chunk {
+    Chunk *next;
+  };
+  struct UsageCounter {
+    size_t generation;
+    size_t bytes;
+  };
+
+  template<class Owner>
+  static UsageCounter& usageCounter() {
+#ifdef ZTS
+    static thread_local UsageCounter counter{size_t(-1), 0};
+#else
+    static UsageCounter counter{size_t(-1), 0};
+#endif
+    return counter;
+  }
+
+  void* allocateSlow(size_t size, size_t alignment) {
+    const size_t header = alignUp(sizeof(Chunk), alignment);
+    if ((header + size) > (chunkSize / 4)) {
+      // Large blocks get a chunk of their own, behind the current one
+      auto chunk = reinterpret_cast<Chunk*>(emalloc(header + size));
+      if (m_chunks) {
+        chunk->next = m_chunks->next;
+        m_chunks->next = chunk;
+      } else {
+        chunk->next = nullptr;
+        m_chunks = chunk;
+      }
+      m_used += size;
+      return reinterpret_cast<char*>(chunk) + header;
+    }
+    auto chunk = reinterpret_cast<Chunk*>(emalloc(chunkSize));
+    chunk->next = m_chunks;
+    m_chunks = chunk;
+    char *ptr = reinterpret_cast<char*>(chunk) + header;
+    m_pos = ptr + size;
+    m_end = reinterpret_cast<char*>(chunk) + chunkSize;
+    m_used += size;
+    return ptr;
+  }
+
+  char *m_pos{nullptr};
+  char *m_end{nullptr};
+  Chunk *m_chunks{nullptr};
+  size_t m_used{0};
+  size_t m_generation{0};
+};
+
+// Standard allocator drawing from the RequestArena,
+// with usage attributed to Owner when given
+template<typename X, class Owner = void>
+struct ArenaAllocator {
+  typedef X value_type;
+  template<typename Y>
+  struct rebind { typedef ArenaAllocator<Y, Owner> other; };
+
+  ArenaAllocator() {}
+  template<typename Y>
+  ArenaAllocator(const ArenaAllocator<Y, Owner>&) {}
+
+  X* allocate(size_t n) {
+    return reinterpret_cast<X*>(
+      RequestArena::instance().allocate<Owner>(n * sizeof(X), alignof(X)));
+  }
+  void deallocate(X *ptr, size_t n) {
+    RequestArena::instance().deallocate(ptr, n * sizeof(X));
+  }
+
+  template<typename Y>
+  bool operator==(const ArenaAllocator<Y, Owner>&) const { return true; }
+  template<typename Y>
+  bool operator!=(const ArenaAllocator<Y, Owner>&) const { return false; }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Cycle collection (see collectable)
+
+namespace {
+template<class T, typename = void>
+struct isCollectable { static constexpr bool value = true; };
+template<class T>
+struct isCollectable<T, typename voidType<decltype(T::collectable)>::type> {
+  static constexpr bool value = T::collectable;
+};
+} // null namespace
+
+template<class T> typename
+  std::enable_if<isCollectable<T>::value>::type
+initObjectGc(zend_object *zobj) {}
+
+template<class T> typename
+  std::enable_if<!isCollectable<T>::value>::type
+initObjectGc(zend_object *zobj) {
+  if (zobj->ce->default_properties_count) {
+    // Userland subclass with properties which may form cycles
+    return;
+  }
+#if PHP_VERSION_ID >= 70400
+  GC_ADD_FLAGS(zobj, GC_NOT_COLLECTABLE);
+#elif PHP_VERSION_ID >= 70300
+  GC_DEL_FLAGS(zobj, GC_COLLECTABLE);
+#else
+  // Possible roots are chosen by the zval's type flags, which every
+  // holder of the object sets for itself, so there's nothing to clear
+#endif
+}
+
+template<class T>
+GcBuffer* gcBuffer(T *obj) {
+  return reinterpret_cast<GcBuffer*>(
+    reinterpret_cast<char*>(obj) + objectLayout<T>::gcOffset);
+}
+
+template<class T> typename
+  std::enable_if<gcVisitable<T>::value>::type
+initGcBuffer(T *obj) {
+  new(gcBuffer(obj)) GcBuffer();
+}
+
+template<class T> typename
+  std::enable_if<!gcVisitable<T>::value>::type
+initGcBuffer(T *obj) {}
+
+template<class T> typename
+  std::enable_if<gcVisitable<T>::value>::type
+dtorGcBuffer(T *obj) {
+  gcBuffer(obj)->~GcBuffer();
+}
+
+template<class T> typename
+  std::enable_if<!gcVisitable<T>::value>::type
+dtorGcBuffer(T *obj) {}
+
+template<class T> typename
+  std::enable_if<gcVisitable<T>::value, HashTable*>::type
+getGcVisit(zval *object, zval **table, int *n) {
+  zend_object *zobj = Z_OBJ_P(object);
+  T *obj = toObject<T>(zobj);
+  auto buf = gcBuffer(obj);
+  buf->clear();
+  obj->gcVisit(*buf);
+  if (!zobj->properties) {
+    // Declared properties of a userland subclass,
+    // otherwise reachable through the properties table returned below
+    for (int i = 0; i < zobj->ce->default_properties_count; ++i) {
+      buf->add(&zobj->properties_table[i]);
+    }
+  }
+  *table = buf->data();
+  *n = buf->size();
+  return zobj->properties;
+}
+
+// Never installed, exists to satisfy expansion from initClassEntry
+template<class T> typename
+  std::enable_if<!gcVisitable<T>::value, HashTable*>::type
+getGcVisit(zval *object, zval **table, int *n) {
+  assert(false);
+  return zend_get_std_object_handlers()->get_gc(object, table, n);
+}
+
+template<class T>
+HashTable* getGcNone(zval *object, zval **table, int *n) {
+  zend_object *zobj = Z_OBJ_P(object);
+  if (UNEXPECTED(zobj->properties || zobj->ce->default_properties_count)) {
+    return zend_get_std_object_handlers()->get_gc(object, table, n);
+  }
+  *table = nullptr;
+  *n = 0;
+  return nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Instance pooling (see pool_size)
+
+namespace {
+template<class T, typename = void>
+struct poolCapacity { static constexpr size_t value = 0; };
+template<class T>
+struct poolCapacity<T, typename voidType<decltype(T::pool_size)>::type> {
+  static constexpr size_t value = T::pool_size;
+};
+} // null namespace
+
+template<class T>
+class ObjectPool {
+ public:
+  static constexpr size_t capacity = poolCapacity<T>::value;
+  static_assert(!capacity || hasReset<T, void()>::value,
+                "Pooled classes must implement void reset()");
+  static_assert(!capacity || std::is_move_constructible<T>::value,
+                "Pooled classes must be move constructible");
+
+  static ObjectPool& instance() {
+#ifdef ZTS
+    static thread_local ObjectPool pool;
+#else
+    static ObjectPool pool;
+#endif
+    return pool;
+  }
+
+  // Reset obj and move it into the pool, false when the pool is full
+  bool put(T& obj) {
+    if (m_count >= capacity) {
+      return false;
+    }
+    obj.reset();
+    new(slot(m_count)) T(std::move(obj));
+    ++m_count;
+    return true;
+  }
+
+  // Move construct ptr from a pooled instance, false when there is none
+  bool take(T *ptr) {
+    if (!m_count) {
+      ++m_misses;
+      return false;
+    }
+    T *pooled = slot(--m_count);
+    new(ptr) T(std::move(*pooled));
+    pooled->~T();
+    ++m_hits;
+    return true;
+  }
+
+  // Destroy every pooled instance
+  void clear() {
+    while (m_count) {
+      slot(--m_count)->~T();
+    }
+  }
+
+  size_t size() const { return m_count; }
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+  void resetStats() { m_hits = m_misses = 0; }
+
+ private:
+  T* slot(size_t idx) { return reinterpret_cast<T*>(&m_slots[idx]); }
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type
+    m_slots[capacity ? capacity : 1];
+  size_t m_count{0};
+  size_t m_hits{0};
+  size_t m_misses{0};
+};
+
+template<class T> typename
+  std::enable_if<!ObjectPool<T>::capacity>::type
+constructObject(T *ptr) {
+  new(ptr) T();
+}
+
+template<class T> typename
+  std::enable_if<(ObjectPool<T>::capacity > 0)>::type
+constructObject(T *ptr) {
+  if (!ObjectPool<T>::instance().take(ptr)) {
+    new(ptr) T();
+  }
+}
+
+template<class T> typename
+  std::enable_if<!ObjectPool<T>::capacity>::type
+destroyObject(T *obj) {
+  obj->~T();
+}
+
+template<class T> typename
+  std::enable_if<(ObjectPool<T>::capacity > 0)>::type
+destroyObject(T *obj) {
+  // Leaves obj moved from (when pooled), but it must still be destructed
+  ObjectPool<T>::instance().put(*obj);
+  obj->~T();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+template<class T, typename InitFunc>
+zend_object* allocObject(zend_class_entry *ce, InitFunc init,
+    size_t count = trailingLayout<T>::storage::default_count) {
+  typedef trailingLayout<T> trailer;
+  T *ptr = reinterpret_cast<T*>(
+    objectAllocator<T>::type::template alloc<T>(ce,
+      trailer::extra(ce, count)));
+  if ((alignof(T) > ZEND_MM_ALIGNMENT) &&
+      UNEXPECTED(reinterpret_cast<zend_uintptr_t>(ptr) & (alignof(T) - 1))) {
+    // Only possible when ZendMM is bypassed (USE_ZEND_ALLOC=0)
+    efree(ptr);
+    zend_error_noreturn(E_CORE_ERROR,
+      "Unable to allocate %zu byte aligned storage for %s",
+      alignof(T), ZSTR_VAL(ce->name));
+  }
+  auto zobj = toZendObject(ptr);
+  if (trailer::enabled) {
+    // Make trailing()/trailingCount() usable from T's constructor
+    zobj->ce = ce;
+    trailer::count(ptr) = count;
+  }
+  initGcBuffer(ptr);
+#ifdef P3_EXCEPTIONS
+  try {
+    init(ptr);
+  } catch (...) {
+    dtorGcBuffer(ptr);
+    efree(ptr);
+    throw;
+  }
+#else
+  init(ptr);
+#endif
+  zend_object_std_init(zobj, ce);
+  zobj->handlers = &T::handlers;
+  initObjectGc<T>(zobj);
+  return zobj;
+}
+
+template<class T> typename
+  std::enable_if<std::is_constructible<T>::value, zend_object*>::type
+createObject(zend_class_entry *ce) {
+  auto obj = callTranslated(static_cast<zend_object*>(nullptr), [ce] {
+    return allocObject<T>(ce, [](T*ptr) { constructObject(ptr); });
+  });
+  // The engine expects an object even when the constructor threw
+  return obj ? obj : zend_objects_new(ce);
+}
+
+template<class T> typename
+  std::enable_if<std::is_constructible<T,const T&>::value, zend_object*>::type
+cloneObject(zval *oldzval) {
+  typedef trailingLayout<T> trailer;
+  T *old = toObject<T>(oldzval);
+  const size_t count = trailer::enabled ? trailer::count(old) : 0;
+  auto obj = callTranslated(static_cast<zend_object*>(nullptr), [&] {
+    return allocObject<T>(
+      Z_OBJCE_P(oldzval),
+      [old, count](T*ptr) {
+        if (trailer::enabled) {
+          memcpy(trailer::data(ptr), trailer::data(old),
+                 count * sizeof(typename trailer::element_type));
+        }
+        new(ptr) T(*old);
+      },
+      count
+    );
+  });
+  // As for createObject(), the engine releases it again
+  return obj ? obj : zend_objects_new(Z_OBJCE_P(oldzval));
+}
+
+// Instantiate T with `count' elements of trailing storage
+template<class T, typename... Args>
+zend_object* newObjectWithStorage(size_t count, Args&&... args) {
+  return allocObject<T>(
+    T::class_entry,
+    [&](T*ptr) { new(ptr) T(std::forward<Args>(args)...); },
+    count
+  );
+}
+
+template<class T>
+void dtorObject(zend_object *obj) {
+  zend_object_std_dtor(obj);
+  destroyObject(toObject<T>(obj));
+  dtorGcBuffer(toObject<T>(obj));
+}
+
+template<class T>
+int castObjectAs(zval *src, zval *dest, int type) {
   switch (type) {
     case IS_UNDEF:  ZVAL_UNDEF(dest); return SUCCESS;
     case IS_NULL:   ZVAL_NULL(dest);  return SUCCESS;
@@ -381,94 +2465,1733 @@ int castObject(zval *src, zval *dest, int type) {
 }
 
 template<class T>
-int compareObject(zval *rv, zval *a, zval *b) {
-  if ((Z_TYPE_P(a) != IS_OBJECT) ||
-     !instanceof_function(Z_OBJCE_P(a), T::class_entry)) {
-    // Invert if needed so that 'a' is always a T
-    ZEND_ASSERT(Z_TYPE_P(b) == IS_OBJECT);
-    ZEND_ASSERT(Z_OBJ_P(b)->handlers == &T::handlers);
-    auto ret = compareObject<T>(rv, b, a);
-    if ((ret == SUCCESS) && (Z_TYPE_P(rv) == IS_LONG)) {
-      ZVAL_LONG(rv, -Z_LVAL_P(rv));
-    }
-    return ret;
+int castObject(zval *src, zval *dest, int type) {
+  const int ret = callTranslated(FAILURE, [&] {
+    return castObjectAs<T>(src, dest, type);
+  });
+  if ((ret == FAILURE) && EG(exception)) {
+    // Callers read the result without checking for an exception
+    ZVAL_NULL(dest);
+    convert_to_explicit_type(dest, type);
+    return SUCCESS;
+  }
+  return ret;
+}
+
+// Compare a T against any other value
+template<class T>
+int compareObjectToValue(zval *rv, T *obj, zval *b) {
+  int ret = FAILURE;
+  switch (Z_TYPE_P(b)) {
+    case IS_UNDEF:
+    case IS_NULL:
+      ret = compareObjectToNull<T>(rv, obj);
+      break;
+#define P3_COMPARE_T(ptype) \
+    case ptype: \
+      ret = compareObjectTo##ptype<T>(rv, obj, phpType<ptype>::get(b)); break;
+P3_COMPARABLE_TYPES(P3_COMPARE_T)
+#undef P3_COMPARE_T
+  }
+  if (ret == FAILURE) {
+    ret = compareObjectToZval<T>(rv, obj, b);
+  }
+  if (ret == FAILURE) {
+    // ZE will crash if rv isn't initialized, even in FAILURE mode
+    ZVAL_LONG(rv, 0);
+  }
+  return ret;
+}
+
+// Instance of T, or of a class derived from it
+template<class T>
+bool isWrapped(zval *zv) {
+  return (Z_TYPE_P(zv) == IS_OBJECT) &&
+    (EXPECTED(Z_OBJ_P(zv)->handlers == &T::handlers) ||
+     (isConstructed(Z_OBJ_P(zv)) &&
+      instanceof_function(Z_OBJCE_P(zv), T::class_entry)));
+}
+
+template<class T>
+int compareObjectAs(zval *rv, zval *a, zval *b) {
+  const bool a_is_t = isWrapped<T>(a);
+  if (EXPECTED(a_is_t && isWrapped<T>(b)) &&
+      (compareObjectToSimilar<T>(rv, toObject<T>(a), *toObject<T>(b))
+        == SUCCESS)) {
+    // Special case for comparing similar objects
+    return SUCCESS;
+  }
+  if (a_is_t) {
+    return compareObjectToValue<T>(rv, toObject<T>(a), b);
+  }
+
+  // Invert so that the T is always on the left
+  ZEND_ASSERT(isWrapped<T>(b));
+  auto ret = compareObjectToValue<T>(rv, toObject<T>(b), a);
+  if ((ret == SUCCESS) && (Z_TYPE_P(rv) == IS_LONG)) {
+    ZVAL_LONG(rv, -Z_LVAL_P(rv));
+  }
+  return ret;
+}
+
+// Defer to the parent class's handler, when there is one
+template<class Base> typename
+  std::enable_if<std::is_void<Base>::value, int>::type
+compareAsParent(zval *rv, zval *a, zval *b) {
+  return FAILURE;
+}
+
+template<class Base> typename
+  std::enable_if<!std::is_void<Base>::value, int>::type
+compareAsParent(zval *rv, zval *a, zval *b) {
+  return Base::handlers.compare(rv, a, b);
+}
+
+template<class T, class Base = void>
+int compareObject(zval *rv, zval *a, zval *b) {
+  ZVAL_LONG(rv, 0);
+  const int ret = callTranslated(FAILURE, [&] {
+    return compareObjectAs<T>(rv, a, b);
+  });
+  // e.g. a T against an instance of Base, which only Base can compare
+  return ((ret == SUCCESS) || EG(exception))
+    ? ret : compareAsParent<Base>(rv, a, b);
+}
+
+// These templates never actually get called,
+// they just exist to satisfy expansion from initClassEntry
+template<class T> typename
+  std::enable_if<!std::is_constructible<T>::value, zend_object*>::type
+createObject(zend_class_entry *ce) {
+  assert(false);
+  return nullptr;
+}
+
+template<class T> typename
+  std::enable_if<!std::is_constructible<T,const T&>::value, zend_object*>::type
+cloneObject(zval *oldzval) {
+  assert(false);
+  return nullptr;
+}
+
+// Throw an exception when trying to directly instantiate
+// a class when no zero-argument constructor is available
+template<class T>
+zend_object* createThrownObject(zend_class_entry *ce) {
+  zend_throw_exception_ex(zend_ce_error, 0,
+    "%s may not be directly instantiated", ZSTR_VAL(ce->name));
+  return zend_objects_new(ce);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Wrapped property access (see P3_PROPERTY)
+
+struct PropertyEntry {
+  const char *name;
+  void (*read)(void *obj, zval *rv);
+  bool (*write)(void *obj, zval *value); // nullptr when read-only
+  zval* (*ptr)(void *obj); // Direct access, zval members only
+};
+
+namespace {
+template<typename U> struct propertyValue {
+  static_assert(!std::is_pointer<U>::value,
+                "Unsupported pointer type for a property or element");
+  typedef phpType<cppType<U>::type> php;
+  static void read(const U& val, zval *rv) { php::make(rv, val); }
+  static bool write(U& val, zval *value) {
+    typename php::type tmp;
+    if (!php::parse(value, tmp)) { return false; }
+    val = tmp;
+    return true;
+  }
+  static zval* ptr(U& val) { return nullptr; }
+};
+// Weak mode string parsing converts its argument in place, so convert
+// a copy instead and leave the caller's variable as it was.
+// On success str holds a new reference.
+inline bool copyArgString(zval *value, zend_string *&str) {
+  zval tmp;
+  ZVAL_DEREF(value);
+  ZVAL_COPY(&tmp, value);
+  const bool ok = parseArgString(&tmp, str);
+  if (ok) { str = zend_string_copy(str); }
+  zval_ptr_dtor(&tmp);
+  return ok;
+}
+
+template<> struct propertyValue<zend_string*> {
+  static void read(zend_string *val, zval *rv) {
+    if (val) {
+      ZVAL_STR_COPY(rv, val);
+    } else {
+      ZVAL_NULL(rv);
+    }
+  }
+  static bool write(zend_string*& val, zval *value) {
+    zend_string *str;
+    if (!copyArgString(value, str)) { return false; }
+    if (val) { zend_string_release(val); }
+    val = str;
+    return true;
+  }
+  static zval* ptr(zend_string*& val) { return nullptr; }
+};
+
+// Immutable arrays are shared without reference counting
+template<typename U>
+bool isCounted(const U *val) { return true; }
+inline bool isCounted(const zend_array *val) {
+  return !(GC_FLAGS(val) & IS_ARRAY_IMMUTABLE);
+}
+
+template<typename U> struct refcountedValue {
+  typedef phpType<cppType<U*>::type> php;
+  static void read(U *val, zval *rv) {
+    if (!val) {
+      ZVAL_NULL(rv);
+    } else if (isCounted(val)) {
+      php::make(rv, val, true);
+    } else {
+      php::make(rv, val, false);
+      Z_TYPE_INFO_P(rv) = Z_TYPE_P(rv);
+    }
+  }
+  static bool write(U*& val, zval *value) {
+    U *ptr;
+    if (!php::parse(value, ptr)) { return false; }
+    zval tmp;
+    php::make(&tmp, ptr, isCounted(ptr));
+    if (val && isCounted(val)) {
+      php::make(&tmp, val, false);
+      zval_ptr_dtor(&tmp);
+    }
+    val = ptr;
+    return true;
+  }
+  static zval* ptr(U*& val) { return nullptr; }
+};
+template<> struct propertyValue<zend_array*> : refcountedValue<zend_array> {};
+template<> struct propertyValue<zend_object*> :
+  refcountedValue<zend_object> {};
+template<> struct propertyValue<zend_resource*> :
+  refcountedValue<zend_resource> {};
+
+template<> struct propertyValue<std::string> {
+  static void read(const std::string& val, zval *rv) {
+    ZVAL_STRINGL(rv, val.data(), val.size());
+  }
+  static bool write(std::string& val, zval *value) {
+    zend_string *str;
+    if (!copyArgString(value, str)) { return false; }
+    Owned<zend_string> owned(str);
+    val.assign(ZSTR_VAL(str), ZSTR_LEN(str));
+    return true;
+  }
+  static zval* ptr(std::string& val) { return nullptr; }
+};
+template<> struct propertyValue<zval> {
+  static void read(const zval& val, zval *rv) {
+    if (Z_ISUNDEF(val)) {
+      ZVAL_NULL(rv);
+    } else {
+      ZVAL_COPY(rv, &val);
+    }
+  }
+  static bool write(zval& val, zval *value) {
+    zval garbage;
+    ZVAL_COPY_VALUE(&garbage, &val);
+    ZVAL_COPY(&val, value);
+    zval_ptr_dtor(&garbage);
+    return true;
+  }
+  static zval* ptr(zval& val) { return &val; }
+};
+
+template<typename M, M member> struct propertyAccess;
+template<class T, typename U, U T::*member>
+struct propertyAccess<U T::*, member> {
+  static void read(void *obj, zval *rv) {
+    propertyValue<U>::read(static_cast<T*>(obj)->*member, rv);
+  }
+  static bool write(void *obj, zval *value) {
+    return propertyValue<U>::write(static_cast<T*>(obj)->*member, value);
+  }
+  static zval* ptr(void *obj) {
+    return propertyValue<U>::ptr(static_cast<T*>(obj)->*member);
+  }
+};
+
+template<class T>
+struct propertyTable {
+  static const PropertyEntry *entries;
+  static zend_string **names;
+  static size_t count;
+};
+template<class T> const PropertyEntry *propertyTable<T>::entries = nullptr;
+template<class T> zend_string **propertyTable<T>::names = nullptr;
+template<class T> size_t propertyTable<T>::count = 0;
+
+template<class T>
+void initPropertyTable(const PropertyEntry *props) {
+  typedef propertyTable<T> table;
+  size_t count = 0;
+  while (props[count].name) { ++count; }
+  table::entries = props;
+  table::count = count;
+  table::names = reinterpret_cast<zend_string**>(
+    pemalloc(sizeof(zend_string*) * (count ? count : 1), 1));
+  for (size_t i = 0; i < count; ++i) {
+    zend_string *name = zend_new_interned_string(
+      zend_string_init(props[i].name, strlen(props[i].name), 1));
+    zend_string_hash_val(name);
+    table::names[i] = name;
+  }
+}
+
+template<class T>
+const PropertyEntry* findProperty(zval *member) {
+  typedef propertyTable<T> table;
+  if (UNEXPECTED(Z_TYPE_P(member) != IS_STRING)) {
+    return nullptr;
+  }
+  zend_string *name = Z_STR_P(member);
+  for (size_t i = 0; i < table::count; ++i) {
+    if (table::names[i] == name) {
+      return table::entries + i;
+    }
+  }
+  // Not the same interned string (e.g. runtime generated name)
+  const zend_ulong h = zend_string_hash_val(name);
+  for (size_t i = 0; i < table::count; ++i) {
+    zend_string *candidate = table::names[i];
+    if ((ZSTR_H(candidate) == h) &&
+        (ZSTR_LEN(candidate) == ZSTR_LEN(name)) &&
+        !memcmp(ZSTR_VAL(candidate), ZSTR_VAL(name), ZSTR_LEN(name))) {
+      return table::entries + i;
+    }
+  }
+  return nullptr;
+}
+} // null namespace
+
+template<class T>
+zval* readProperty(zval *object, zval *member, int type,
+                   void **cache_slot, zval *rv) {
+  auto prop = findProperty<T>(member);
+  if (!prop) {
+    return zend_get_std_object_handlers()->read_property(
+      object, member, type, cache_slot, rv);
+  }
+  prop->read(toObject<T>(object), rv);
+  return rv;
+}
+
+#if PHP_VERSION_ID >= 70400
+// From PHP 7.4 write_property returns the assigned value,
+// or &EG(error_zval) when the assignment failed
+typedef zval* writePropertyResult;
+inline zval* writePropertyDone(zval *value) { return value; }
+#else
+typedef void writePropertyResult;
+inline void writePropertyDone(zval *value) {}
+#endif
+
+template<class T>
+writePropertyResult writeProperty(zval *object, zval *member, zval *value,
+                                  void **cache_slot) {
+  auto prop = findProperty<T>(member);
+  if (!prop) {
+    return zend_get_std_object_handlers()->write_property(
+      object, member, value, cache_slot);
+  }
+  if (!prop->write) {
+    zend_throw_error(nullptr, "Cannot modify read-only property %s::$%s",
+                     ZSTR_VAL(Z_OBJCE_P(object)->name), prop->name);
+    return writePropertyDone(&EG(error_zval));
+  }
+  if (!prop->write(toObject<T>(object), value)) {
+    zend_type_error("Cannot assign %s to property %s::$%s",
+                    zend_zval_type_name(value),
+                    ZSTR_VAL(Z_OBJCE_P(object)->name), prop->name);
+    return writePropertyDone(&EG(error_zval));
+  }
+  return writePropertyDone(value);
+}
+
+template<class T>
+int hasProperty(zval *object, zval *member, int has_set_exists,
+                void **cache_slot) {
+  auto prop = findProperty<T>(member);
+  if (!prop) {
+    return zend_get_std_object_handlers()->has_property(
+      object, member, has_set_exists, cache_slot);
+  }
+  if (has_set_exists == 2 /* property_exists() */) {
+    return 1;
+  }
+  zval tmp;
+  prop->read(toObject<T>(object), &tmp);
+  int ret = (has_set_exists == 0 /* isset() */)
+    ? (Z_TYPE(tmp) != IS_NULL) : zend_is_true(&tmp);
+  zval_ptr_dtor(&tmp);
+  return ret;
+}
+
+template<class T>
+void unsetProperty(zval *object, zval *member, void **cache_slot) {
+  auto prop = findProperty<T>(member);
+  if (!prop) {
+    zend_get_std_object_handlers()->unset_property(
+      object, member, cache_slot);
+    return;
+  }
+  zend_throw_error(nullptr, "Cannot unset wrapped property %s::$%s",
+                   ZSTR_VAL(Z_OBJCE_P(object)->name), prop->name);
+}
+
+template<class T>
+zval* getPropertyPtrPtr(zval *object, zval *member, int type,
+                        void **cache_slot) {
+  auto prop = findProperty<T>(member);
+  if (!prop) {
+    return zend_get_std_object_handlers()->get_property_ptr_ptr(
+      object, member, type, cache_slot);
+  }
+  // nullptr makes the engine fall back on read/write_property
+  return prop->ptr ? prop->ptr(toObject<T>(object)) : nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Dimension access (see at()/operator[]/contains()/erase())
+
+namespace {
+enum dimResult { DIM_UNSUPPORTED, DIM_MISSING, DIM_INVALID, DIM_FOUND };
+
+// Whether operator[] may be used to insert keys contains() rejects
+template<class T, typename = void>
+struct dimInserts { static constexpr bool value = false; };
+template<class T>
+struct dimInserts<T, typename voidType<decltype(T::dim_insert)>::type> {
+  static constexpr bool value = T::dim_insert;
+};
+
+template<class T, typename K,
+         bool = dimAt<T, K>::value, bool = dimGet<T, K>::value>
+struct dimRead {
+  static dimResult read(const T& obj, K key, zval *rv) {
+    return DIM_UNSUPPORTED;
+  }
+};
+template<class T, typename K, bool get>
+struct dimRead<T, K, true, get> {
+  static dimResult read(const T& obj, K key, zval *rv) {
+    typedef typename std::decay<typename dimAt<T, K>::result>::type U;
+    if (!obj.contains(key)) { return DIM_MISSING; }
+    propertyValue<U>::read(obj.at(key), rv);
+    return DIM_FOUND;
+  }
+};
+template<class T, typename K>
+struct dimRead<T, K, false, true> {
+  static dimResult read(const T& obj, K key, zval *rv) {
+    typedef typename std::decay<typename dimGet<T, K>::result>::type U;
+    if (!obj.contains(key)) { return DIM_MISSING; }
+    propertyValue<U>::read(obj[key], rv);
+    return DIM_FOUND;
+  }
+};
+
+template<class T, typename K, bool = dimAssignable<T, K>::value>
+struct dimWrite {
+  static dimResult write(T& obj, K key, zval *value) {
+    return DIM_UNSUPPORTED;
+  }
+};
+template<class T, typename K>
+struct dimWrite<T, K, true> {
+  static dimResult write(T& obj, K key, zval *value) {
+    typedef typename std::decay<typename dimSet<T, K>::result>::type U;
+    if (!dimInserts<T>::value && !obj.contains(key)) { return DIM_MISSING; }
+    return propertyValue<U>::write(obj[key], value) ? DIM_FOUND : DIM_INVALID;
+  }
+};
+
+template<class T, typename K, bool = dimContains<T, K>::value>
+struct dimHas {
+  static dimResult has(const T& obj, K key) { return DIM_UNSUPPORTED; }
+};
+template<class T, typename K>
+struct dimHas<T, K, true> {
+  static dimResult has(const T& obj, K key) {
+    return obj.contains(key) ? DIM_FOUND : DIM_MISSING;
+  }
+};
+
+template<class T, typename K, bool = dimErase<T, K>::value>
+struct dimUnset {
+  static dimResult unset(T& obj, K key) { return DIM_UNSUPPORTED; }
+};
+template<class T, typename K>
+struct dimUnset<T, K, true> {
+  static dimResult unset(T& obj, K key) {
+    obj.erase(key);
+    return DIM_FOUND;
+  }
+};
+
+struct dimKey {
+  zend_uchar type;
+  zend_long lval;
+  const zend_string *str;
+};
+
+// Resolve an offset to a zend_long, or a string for classes taking them
+template<class T>
+bool decodeDimension(zval *offset, dimKey &key) {
+  key.type = IS_LONG;
+  ZVAL_DEREF(offset);
+  switch (Z_TYPE_P(offset)) {
+    case IS_LONG:
+      key.lval = Z_LVAL_P(offset);
+      return true;
+    case IS_STRING: {
+      if (dimOps<T, const zend_string*>::any) {
+        key.type = IS_STRING;
+        key.str = Z_STR_P(offset);
+        return true;
+      }
+      zend_ulong idx;
+      if (ZEND_HANDLE_NUMERIC_STR_EX(Z_STRVAL_P(offset),
+                                     Z_STRLEN_P(offset), idx)) {
+        key.lval = (zend_long)idx;
+        return true;
+      }
+      break;
+    }
+    case IS_DOUBLE:
+      key.lval = zend_dval_to_lval(Z_DVAL_P(offset));
+      return true;
+    case IS_NULL:
+    case IS_FALSE:
+      key.lval = 0;
+      return true;
+    case IS_TRUE:
+      key.lval = 1;
+      return true;
+  }
+  zend_error(E_WARNING, "Illegal offset type");
+  return false;
+}
+
+inline void throwDimensionUnsupported(zval *object, const char *op) {
+  zend_throw_error(nullptr, "Cannot %s offset of object of type %s",
+                   op, ZSTR_VAL(Z_OBJCE_P(object)->name));
+}
+} // null namespace
+
+template<class T>
+zval* readDimension(zval *object, zval *offset, int type, zval *rv) {
+  return callTranslated(&EG(uninitialized_zval), [&]() -> zval* {
+    dimKey key;
+    if (UNEXPECTED(!offset)) {
+      zend_throw_error(nullptr, "Cannot use [] for reading");
+      return &EG(uninitialized_zval);
+    }
+    if (!decodeDimension<T>(offset, key)) {
+      return &EG(uninitialized_zval);
+    }
+    const T &obj = *toObject<T>(object);
+    switch ((key.type == IS_LONG)
+      ? dimRead<T, zend_long>::read(obj, key.lval, rv)
+      : dimRead<T, const zend_string*>::read(obj, key.str, rv)) {
+      case DIM_FOUND:
+        return rv;
+      case DIM_MISSING:
+        if (type != BP_VAR_IS) {
+          if (key.type == IS_LONG) {
+            zend_error(E_NOTICE, "Undefined offset: " ZEND_LONG_FMT,
+                       key.lval);
+          } else {
+            zend_error(E_NOTICE, "Undefined index: %s", ZSTR_VAL(key.str));
+          }
+        }
+        return &EG(uninitialized_zval);
+      default:
+        throwDimensionUnsupported(object, "read");
+        return &EG(uninitialized_zval);
+    }
+  });
+}
+
+template<class T>
+void writeDimension(zval *object, zval *offset, zval *value) {
+  callTranslated([&] {
+    dimKey key;
+    if (UNEXPECTED(!offset)) {
+      zend_throw_error(nullptr, "[] operator not supported for %s",
+                       ZSTR_VAL(Z_OBJCE_P(object)->name));
+      return;
+    }
+    if (!decodeDimension<T>(offset, key)) {
+      return;
+    }
+    T &obj = *toObject<T>(object);
+    switch ((key.type == IS_LONG)
+      ? dimWrite<T, zend_long>::write(obj, key.lval, value)
+      : dimWrite<T, const zend_string*>::write(obj, key.str, value)) {
+      case DIM_FOUND:
+        return;
+      case DIM_MISSING:
+        if (key.type == IS_LONG) {
+          zend_throw_error(nullptr, "Cannot write undefined offset "
+                           ZEND_LONG_FMT " of object of type %s", key.lval,
+                           ZSTR_VAL(Z_OBJCE_P(object)->name));
+        } else {
+          zend_throw_error(nullptr, "Cannot write undefined index %s "
+                           "of object of type %s", ZSTR_VAL(key.str),
+                           ZSTR_VAL(Z_OBJCE_P(object)->name));
+        }
+        return;
+      case DIM_INVALID:
+        zend_type_error("Cannot assign %s to offset of object of type %s",
+                        zend_zval_type_name(value),
+                        ZSTR_VAL(Z_OBJCE_P(object)->name));
+        return;
+      default:
+        throwDimensionUnsupported(object, "write");
+    }
+  });
+}
+
+template<class T>
+int hasDimension(zval *object, zval *offset, int check_empty) {
+  return callTranslated(0, [&]() -> int {
+    dimKey key;
+    if (!decodeDimension<T>(offset, key)) {
+      return 0;
+    }
+    const T &obj = *toObject<T>(object);
+    switch ((key.type == IS_LONG)
+      ? dimHas<T, zend_long>::has(obj, key.lval)
+      : dimHas<T, const zend_string*>::has(obj, key.str)) {
+      case DIM_FOUND:
+        break;
+      case DIM_MISSING:
+        return 0;
+      default:
+        throwDimensionUnsupported(object, "check");
+        return 0;
+    }
+
+    // isset() is false for NULL values, empty() for falsy ones
+    zval tmp;
+    ZVAL_UNDEF(&tmp);
+    if (key.type == IS_LONG) {
+      dimRead<T, zend_long>::read(obj, key.lval, &tmp);
+    } else {
+      dimRead<T, const zend_string*>::read(obj, key.str, &tmp);
+    }
+    if (Z_ISUNDEF(tmp)) {
+      // Not readable, existence is all we can report
+      return 1;
+    }
+    int ret = check_empty ? zend_is_true(&tmp) : (Z_TYPE(tmp) != IS_NULL);
+    zval_ptr_dtor(&tmp);
+    return ret;
+  });
+}
+
+template<class T>
+void unsetDimension(zval *object, zval *offset) {
+  callTranslated([&] {
+    dimKey key;
+    if (!decodeDimension<T>(offset, key)) {
+      return;
+    }
+    T &obj = *toObject<T>(object);
+    if (((key.type == IS_LONG)
+      ? dimUnset<T, zend_long>::unset(obj, key.lval)
+      : dimUnset<T, const zend_string*>::unset(obj, key.str))
+        == DIM_UNSUPPORTED) {
+      throwDimensionUnsupported(object, "unset");
+    }
+  });
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// foreach support (see begin()/end())
+
+namespace {
+template<typename E>
+struct iteratorElement {
+  static void key(const E& elem, zend_long index, zval *key) {
+    ZVAL_LONG(key, index);
+  }
+  static void value(const E& elem, zval *value) {
+    propertyValue<E>::read(elem, value);
+  }
+};
+template<typename K, typename V>
+struct iteratorElement<std::pair<K, V>> {
+  static void key(const std::pair<K, V>& elem, zend_long index, zval *key) {
+    propertyValue<typename std::remove_const<K>::type>::read(elem.first, key);
+  }
+  static void value(const std::pair<K, V>& elem, zval *value) {
+    propertyValue<V>::read(elem.second, value);
+  }
+};
+
+template<class T>
+struct objectIterator {
+  typedef typename isIterable<T>::iterator iterator;
+  typedef iteratorElement<typename std::decay<
+    decltype(*std::declval<iterator>())>::type> element;
+
+  zend_object_iterator it; // Must be first
+  iterator cur;
+  iterator end;
+  zend_long index;
+  zval value;
+
+  static objectIterator* from(zend_object_iterator *iter) {
+    return reinterpret_cast<objectIterator*>(iter);
+  }
+  const T& object() { return *toObject<T>(&it.data); }
+
+  static void dtor(zend_object_iterator *iter) {
+    auto self = from(iter);
+    zval_ptr_dtor(&self->value);
+    zval_ptr_dtor(&self->it.data);
+    self->cur.~iterator();
+    self->end.~iterator();
+  }
+  static int valid(zend_object_iterator *iter) {
+    auto self = from(iter);
+    return callTranslated(FAILURE, [self] {
+      return (self->cur != self->end) ? SUCCESS : FAILURE;
+    });
+  }
+  static zval* currentData(zend_object_iterator *iter) {
+    auto self = from(iter);
+    if (Z_ISUNDEF(self->value)) {
+      callTranslated([self] {
+        element::value(*self->cur, &self->value);
+      });
+      if (Z_ISUNDEF(self->value)) {
+        return &EG(uninitialized_zval);
+      }
+    }
+    return &self->value;
+  }
+  static void currentKey(zend_object_iterator *iter, zval *key) {
+    auto self = from(iter);
+    ZVAL_NULL(key);
+    callTranslated([self, key] {
+      element::key(*self->cur, self->index, key);
+    });
+  }
+  static void moveForward(zend_object_iterator *iter) {
+    auto self = from(iter);
+    zval_ptr_dtor(&self->value);
+    ZVAL_UNDEF(&self->value);
+    callTranslated([self] { ++self->cur; });
+    ++self->index;
+  }
+  static void rewind(zend_object_iterator *iter) {
+    auto self = from(iter);
+    zval_ptr_dtor(&self->value);
+    ZVAL_UNDEF(&self->value);
+    callTranslated([self] {
+      self->cur = self->object().begin();
+      self->end = self->object().end();
+    });
+    self->index = 0;
+  }
+
+  static zend_object_iterator_funcs funcs;
+};
+template<class T>
+zend_object_iterator_funcs objectIterator<T>::funcs = {
+  objectIterator<T>::dtor,
+  objectIterator<T>::valid,
+  objectIterator<T>::currentData,
+  objectIterator<T>::currentKey,
+  objectIterator<T>::moveForward,
+  objectIterator<T>::rewind,
+  nullptr, /* invalidate_current */
+};
+} // null namespace
+
+template<class T> typename
+  std::enable_if<isIterable<T>::value, zend_object_iterator*>::type
+getIterator(zend_class_entry *ce, zval *object, int by_ref) {
+  typedef objectIterator<T> iterator;
+  if (by_ref) {
+    zend_throw_error(nullptr,
+      "An iterator cannot be used with foreach by reference");
+    return nullptr;
+  }
+  auto self = reinterpret_cast<iterator*>(emalloc(sizeof(iterator)));
+  // Construct the C++ iterators first: once zend_iterator_init() has
+  // registered self in the objects store it may no longer simply be freed
+  const T &obj = *toObject<T>(object);
+  const bool ok = callTranslated(false, [self, &obj] {
+    typename iterator::iterator begin(obj.begin());
+    new (&self->end) typename iterator::iterator(obj.end());
+    new (&self->cur) typename iterator::iterator(std::move(begin));
+    return true;
+  });
+  if (!ok) {
+    efree(self);
+    return nullptr;
+  }
+  zend_iterator_init(&self->it);
+  ZVAL_COPY(&self->it.data, object);
+  self->it.funcs = &iterator::funcs;
+  self->index = 0;
+  ZVAL_UNDEF(&self->value);
+  return &self->it;
+}
+
+template<class T> typename
+  std::enable_if<!isIterable<T>::value, zend_object_iterator*>::type
+getIterator(zend_class_entry *ce, zval *object, int by_ref) {
+  assert(false);
+  return nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// count() support (see size()/count())
+
+namespace {
+template<class T, bool = sizeAccessor<T>::value,
+                  bool = countAccessor<T>::value>
+struct countable { static constexpr bool value = false; };
+template<class T, bool count>
+struct countable<T, true, count> : sizeAccessor<T> {};
+template<class T>
+struct countable<T, false, true> : countAccessor<T> {};
+} // null namespace
+
+template<class T> typename
+  std::enable_if<countable<T>::value, int>::type
+countElements(zval *object, zend_long *count) {
+  *count = 0;
+  // Still SUCCESS after an exception, which count() then throws
+  callTranslated([&] {
+    *count = countable<T>::get(*toObject<T>(object));
+  });
+  return SUCCESS;
+}
+
+template<class T> typename
+  std::enable_if<!countable<T>::value, int>::type
+countElements(zval *object, zend_long *count) {
+  return FAILURE;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Native sorting (see p3::sort()/sortKey())
+
+namespace {
+template<class T>
+struct sortItem {
+  T *obj;
+  zend_object *zobj;
+};
+
+// Unwrap every element, or throw a TypeError
+template<class T>
+bool unwrapArray(const zend_array *arr, std::vector<sortItem<T>>& objs) {
+  zval *zv;
+  objs.reserve(zend_hash_num_elements(arr));
+  ZEND_HASH_FOREACH_VAL(const_cast<zend_array*>(arr), zv) {
+    ZVAL_DEREF(zv);
+    if (!isWrapped<T>(zv)) {
+      zend_type_error("Sorted elements must be %s, %s given",
+                      ZSTR_VAL(T::class_entry->name),
+                      zend_zval_type_name(zv));
+      return false;
+    }
+    objs.push_back({ toObject<T>(zv), Z_OBJ_P(zv) });
+  } ZEND_HASH_FOREACH_END();
+  return true;
+}
+
+template<class T>
+Owned<zend_array> packObjects(const std::vector<sortItem<T>>& objs) {
+  zval ret;
+  array_init_size(&ret, objs.size());
+  zend_hash_real_init(Z_ARRVAL(ret), 1);
+  ZEND_HASH_FILL_PACKED(Z_ARRVAL(ret)) {
+    for (const auto& item : objs) {
+      zval tmp;
+      ZVAL_OBJ(&tmp, item.zobj);
+      Z_ADDREF(tmp);
+      ZEND_HASH_FILL_ADD(&tmp);
+    }
+  } ZEND_HASH_FILL_END();
+  return Owned<zend_array>(Z_ARR(ret));
+}
+
+template<class T>
+struct lessByCompare {
+  static_assert(comparesSimilar<T>::value,
+                "Sorting requires int compare(const T&) const");
+  bool operator()(const sortItem<T>& a, const sortItem<T>& b) const {
+    return a.obj->compare(*b.obj) < 0;
+  }
+};
+
+// Order preserving unsigned image of a key, for radix sorting
+template<typename K, typename = void>
+struct radixKey { static constexpr bool value = false; };
+template<typename K>
+struct radixKey<K, typename std::enable_if<std::is_integral<K>::value &&
+                   !std::is_same<K, bool>::value>::type> {
+  static constexpr bool value = true;
+  typedef typename std::make_unsigned<K>::type type;
+  static type get(K key) {
+    return std::is_signed<K>::value
+      ? (type(key) ^ (type(1) << (sizeof(type) * 8 - 1))) : type(key);
+  }
+};
+template<>
+struct radixKey<double> {
+  static constexpr bool value = true;
+  typedef uint64_t type;
+  static type get(double key) {
+    uint64_t bits;
+    memcpy(&bits, &key, sizeof(bits));
+    return (bits >> 63) ? ~bits : (bits | (uint64_t(1) << 63));
+  }
+};
+
+// LSD radix sort on (key, object) pairs, stable
+template<typename U, typename E>
+void radixSort(std::vector<std::pair<U, E>>& items) {
+  std::vector<std::pair<U, E>> scratch(items.size());
+  for (size_t shift = 0; shift < (sizeof(U) * 8); shift += 8) {
+    size_t counts[256] = {0};
+    for (const auto& item : items) {
+      ++counts[(item.first >> shift) & 0xFF];
+    }
+    if (counts[(items[0].first >> shift) & 0xFF] == items.size()) {
+      // Every key has the same byte here
+      continue;
+    }
+    size_t pos = 0;
+    for (auto& count : counts) {
+      const size_t n = count;
+      count = pos;
+      pos += n;
+    }
+    for (const auto& item : items) {
+      scratch[counts[(item.first >> shift) & 0xFF]++] = item;
+    }
+    items.swap(scratch);
+  }
+}
+
+template<class T>
+struct sortKeyOf {
+  typedef typename std::decay<
+    decltype(std::declval<const T&>().sortKey())>::type type;
+};
+
+template<class T, typename K> typename
+  std::enable_if<radixKey<K>::value>::type
+sortObjectsByKey(std::vector<sortItem<T>>& objs) {
+  typedef radixKey<K> radix;
+  std::vector<std::pair<typename radix::type, sortItem<T>>> items;
+  items.reserve(objs.size());
+  for (const auto& item : objs) {
+    items.emplace_back(radix::get(item.obj->sortKey()), item);
+  }
+  radixSort(items);
+  for (size_t i = 0; i < items.size(); ++i) {
+    objs[i] = items[i].second;
   }
+}
 
-  auto obj = toObject<T>(a);
-  if ((Z_TYPE_P(b) == IS_OBJECT) &&
-      (Z_OBJ_P(b)->handlers == &T::handlers) &&
-      (compareObjectToSimilar<T>(rv, obj, *toObject<T>(b)) == SUCCESS)) {
-    // Special case for comparing similar objects
-    return SUCCESS;
+template<class T, typename K> typename
+  std::enable_if<!radixKey<K>::value>::type
+sortObjectsByKey(std::vector<sortItem<T>>& objs) {
+  typedef std::pair<K, sortItem<T>> keyed;
+  std::vector<keyed> items;
+  items.reserve(objs.size());
+  for (const auto& item : objs) {
+    items.emplace_back(item.obj->sortKey(), item);
+  }
+  std::stable_sort(items.begin(), items.end(),
+    [](const keyed& a, const keyed& b) {
+      return a.first < b.first;
+    });
+  for (size_t i = 0; i < items.size(); ++i) {
+    objs[i] = items[i].second;
   }
+}
+} // null namespace
 
-  int ret = FAILURE;
-  switch (Z_TYPE_P(b)) {
-    case IS_UNDEF:
-    case IS_NULL:
-      ret = compareObjectToNull<T>(rv, obj);
+template<class T>
+Owned<zend_array> sort(const zend_array *arr) {
+  std::vector<sortItem<T>> objs;
+  if (!unwrapArray(arr, objs)) {
+    return Owned<zend_array>();
+  }
+  std::sort(objs.begin(), objs.end(), lessByCompare<T>());
+  return packObjects(objs);
+}
+
+template<class T>
+Owned<zend_array> stableSort(const zend_array *arr) {
+  std::vector<sortItem<T>> objs;
+  if (!unwrapArray(arr, objs)) {
+    return Owned<zend_array>();
+  }
+  std::stable_sort(objs.begin(), objs.end(), lessByCompare<T>());
+  return packObjects(objs);
+}
+
+template<class T>
+Owned<zend_array> sortByKey(const zend_array *arr) {
+  std::vector<sortItem<T>> objs;
+  if (!unwrapArray(arr, objs)) {
+    return Owned<zend_array>();
+  }
+  if (objs.size() > 1) {
+    sortObjectsByKey<T, typename sortKeyOf<T>::type>(objs);
+  }
+  return packObjects(objs);
+}
+
+// The above as static methods, for binding with P3_STATIC_ME_NATIVE
+template<class T>
+struct SortMethods {
+  static Owned<zend_array> sort(const zend_array *arr) {
+    return ::p3::sort<T>(arr);
+  }
+  static Owned<zend_array> stableSort(const zend_array *arr) {
+    return ::p3::stableSort<T>(arr);
+  }
+  static Owned<zend_array> sortByKey(const zend_array *arr) {
+    return ::p3::sortByKey<T>(arr);
+  }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Arithmetic and bitwise operators (see operator+)
+
+// A T result becomes a new instance, as does that of a wrapped base class
+// (from an inherited operator), anything else goes through the type map
+template<class T, typename R> typename
+  std::enable_if<std::is_base_of<R, T>::value>::type
+setOperatorResult(zval *rv, R&& val) {
+  ZVAL_OBJ(rv, allocObject<R>(R::class_entry,
+    [&val](R *ptr) { new(ptr) R(std::move(val)); }));
+}
+
+template<class T, typename R> typename
+  std::enable_if<!std::is_base_of<R, T>::value>::type
+setOperatorResult(zval *rv, R&& val) {
+  returnValue<R>::set(rv, std::move(val));
+}
+
+template<class T, template<class, typename, typename = void> class Op,
+         typename A> typename
+  std::enable_if<Op<T, A>::value, int>::type
+applyOperator(zval *rv, const T& a, A b) {
+  setOperatorResult<T>(rv, Op<T, A>::apply(a, b));
+  return SUCCESS;
+}
+
+template<class T, template<class, typename, typename = void> class Op,
+         typename A> typename
+  std::enable_if<!Op<T, A>::value, int>::type
+applyOperator(zval *rv, const T& a, A b) {
+  return FAILURE;
+}
+
+template<class T, template<class, typename, typename = void> class Op>
+int dispatchOperator(zval *rv, zval *op1, zval *op2) {
+  if (!isWrapped<T>(op1)) {
+    return FAILURE;
+  }
+  const T& a = *toObject<T>(op1);
+  switch (Z_TYPE_P(op2)) {
+    case IS_LONG:
+      return applyOperator<T, Op, zend_long>(rv, a, Z_LVAL_P(op2));
+    case IS_DOUBLE:
+      return applyOperator<T, Op, double>(rv, a, Z_DVAL_P(op2));
+    case IS_STRING:
+      return applyOperator<T, Op, const zend_string*>(rv, a, Z_STR_P(op2));
+    case IS_OBJECT:
+      if (isWrapped<T>(op2)) {
+        return applyOperator<T, Op, const T&>(rv, a, *toObject<T>(op2));
+      }
+      return FAILURE;
+    default:
+      return FAILURE;
+  }
+}
+
+// Defer to the parent class's handler, when there is one
+template<class Base>
+struct parentOperators {
+  static constexpr bool value = hasOperators<Base>::value;
+};
+template<>
+struct parentOperators<void> { static constexpr bool value = false; };
+
+template<class Base> typename
+  std::enable_if<!parentOperators<Base>::value, int>::type
+operateAsParent(zend_uchar opcode, zval *result, zval *op1, zval *op2) {
+  return FAILURE;
+}
+
+template<class Base> typename
+  std::enable_if<parentOperators<Base>::value, int>::type
+operateAsParent(zend_uchar opcode, zval *result, zval *op1, zval *op2) {
+  return Base::handlers.do_operation(opcode, result, op1, op2);
+}
+
+template<class T, class Base = void>
+int doOperation(zend_uchar opcode, zval *result, zval *op1, zval *op2) {
+  zval rv;
+  int ret;
+  switch (opcode) {
+#define P3_OPERATOR_CASE(opcode, name, trait, op) \
+    case opcode: \
+      ret = callTranslated(FAILURE, [&] { \
+        return dispatchOperator<T, name>(&rv, op1, op2); \
+      }); \
       break;
-#define P3_COMPARE_T(ptype) \
-    case ptype: \
-      ret = compareObjectTo##ptype<T>(rv, obj, phpType<ptype>::get(b)); break;
-P3_COMPARABLE_TYPES(P3_COMPARE_T)
-#undef P3_COMPARE_T
+P3_BINARY_OPERATORS(P3_OPERATOR_CASE)
+#undef P3_OPERATOR_CASE
+    default:
+      return FAILURE;
   }
-  if (ret == FAILURE) {
-    ret = compareObjectToZval<T>(rv, obj, b);
+  if ((ret == FAILURE) && EG(exception)) {
+    // Handled, so that the engine doesn't try its own operator as well
+    if (result != op1) {
+      ZVAL_NULL(result);
+    }
+    return SUCCESS;
   }
   if (ret == FAILURE) {
-    // ZE will crash if rv isn't initialized, even in FAILURE mode
-    ZVAL_LONG(rv, 0);
+    // e.g. an operator inherited from Base taking a const Base&
+    return operateAsParent<Base>(opcode, result, op1, op2);
   }
-  return ret;
+  if (result == op1) {
+    // Compound assignment, op1 is replaced by the result
+    zval_ptr_dtor(result);
+  }
+  ZVAL_COPY_VALUE(result, &rv);
+  return SUCCESS;
 }
 
-// These templates never actually get called,
-// they just exist to satisfy expansion from initClassEntry
+/////////////////////////////////////////////////////////////////////////////
+// Callable objects (see operator())
+
+namespace {
+template<class T, typename = void>
+struct invocable { static constexpr bool value = false; };
+template<class T>
+struct invocable<T, typename voidType<decltype(&T::operator())>::type> {
+  static constexpr bool value = true;
+  typedef decltype(&T::operator()) method;
+};
+
+// Function entry handed to the engine in place of __invoke()
+template<class T>
+struct invokeFunction {
+  typedef typename invocable<T>::method method;
+  typedef nativeArgInfo<method> arginfo;
+  static constexpr uint32_t num_args =
+    (sizeof(arginfo::info) / sizeof(arginfo::info[0])) - 1;
+
+  static zend_internal_function func;
+
+  static void init() {
+    func.type = ZEND_INTERNAL_FUNCTION;
+    func.fn_flags = ZEND_ACC_PUBLIC;
+    func.function_name = zend_new_interned_string(
+      zend_string_init("__invoke", sizeof("__invoke") - 1, 1));
+    func.scope = T::class_entry;
+    func.num_args = num_args;
+    func.required_num_args = num_args;
+    func.arg_info = const_cast<zend_internal_arg_info*>(arginfo::info + 1);
+    func.handler = nativeMethod<method, &T::operator()>::invoke;
+  }
+};
+template<class T>
+zend_internal_function invokeFunction<T>::func;
+} // null namespace
+
 template<class T> typename
-  std::enable_if<!std::is_constructible<T>::value, zend_object*>::type
-createObject(zend_class_entry *ce) {
-  assert(false);
-  return nullptr;
+  std::enable_if<invocable<T>::value, int>::type
+getClosure(zval *obj, zend_class_entry **ce_ptr,
+           zend_function **fptr_ptr, zend_object **obj_ptr) {
+  zend_class_entry *ce = Z_OBJCE_P(obj);
+  if (UNEXPECTED(ce != T::class_entry)) {
+    auto fn = reinterpret_cast<zend_function*>(zend_hash_str_find_ptr(
+      &ce->function_table, "__invoke", sizeof("__invoke") - 1));
+    if (fn && (fn->type == ZEND_USER_FUNCTION)) {
+      return zend_get_std_object_handlers()->get_closure(
+        obj, ce_ptr, fptr_ptr, obj_ptr);
+    }
+  }
+  *ce_ptr = ce;
+  *fptr_ptr = reinterpret_cast<zend_function*>(&invokeFunction<T>::func);
+  *obj_ptr = Z_OBJ_P(obj);
+  return SUCCESS;
 }
 
 template<class T> typename
-  std::enable_if<!std::is_constructible<T,const T&>::value, zend_object*>::type
-cloneObject(zval *oldzval) {
-  assert(false);
-  return nullptr;
+  std::enable_if<invocable<T>::value>::type
+initClosure() {
+  invokeFunction<T>::init();
+  T::handlers.get_closure = getClosure<T>;
 }
 
-// Throw an exception when trying to directly instantiate
-// a class when no zero-argument constructor is available
+template<class T> typename
+  std::enable_if<!invocable<T>::value>::type
+initClosure() {}
+
+/////////////////////////////////////////////////////////////////////////////
+// Engine interfaces (see Countable/Traversable/JsonSerializable)
+
+namespace {
+ZEND_BEGIN_ARG_INFO_EX(arginfoNone, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfoUnserialize, 0, 0, 1)
+  ZEND_ARG_INFO(0, data)
+ZEND_END_ARG_INFO()
+
+// Append a method unless the class already binds one by that name
+inline void addInterfaceMethod(std::vector<zend_function_entry>& methods,
+                               const zend_function_entry& method) {
+  const size_t len = strlen(method.fname);
+  for (const auto& entry : methods) {
+    if (!zend_binary_strcasecmp(entry.fname, strlen(entry.fname),
+                                method.fname, len)) {
+      return;
+    }
+  }
+  methods.push_back(method);
+}
+
+inline void implementInterface(zend_class_entry *ce,
+                               zend_class_entry *iface) {
+  if (iface && !instanceof_function(ce, iface)) {
+    zend_class_implements(ce, 1, iface);
+  }
+}
+
+template<class T, bool = countable<T>::value>
+struct countableInterface {
+  static void addMethods(std::vector<zend_function_entry>& methods) {}
+  static void implement() {}
+};
 template<class T>
-zend_object* createThrownObject(zend_class_entry *ce) {
-  zend_throw_exception_ex(zend_ce_error, 0,
-    "%s may not be directly instantiated", ZSTR_VAL(ce->name));
-  return zend_objects_new(ce);
+struct countableInterface<T, true> {
+  static void count(INTERNAL_FUNCTION_PARAMETERS) {
+    if (zend_parse_parameters_none() == FAILURE) { return; }
+    callTranslated([&] {
+      const T *self = thisObject<T>(getThis());
+      if (self) { RETURN_LONG(countable<T>::get(*self)); }
+    });
+  }
+  static void addMethods(std::vector<zend_function_entry>& methods) {
+    static const zend_function_entry method[] = {
+      ZEND_FENTRY(count, count, arginfoNone, ZEND_ACC_PUBLIC)
+      PHP_FE_END
+    };
+    addInterfaceMethod(methods, method[0]);
+  }
+  static void implement() {
+    implementInterface(T::class_entry, zend_ce_countable);
+  }
+};
+
+template<class T, bool = hasToString<T, zend_string*() const>::value>
+struct stringableInterface {
+  static void addMethods(std::vector<zend_function_entry>& methods) {}
+  static void implement() {}
+};
+template<class T>
+struct stringableInterface<T, true> {
+  static void toString(INTERNAL_FUNCTION_PARAMETERS) {
+    if (zend_parse_parameters_none() == FAILURE) { return; }
+    callTranslated([&] {
+      const T *self = thisObject<T>(getThis());
+      if (self) { RETURN_STR(self->toString()); }
+    });
+  }
+  static void addMethods(std::vector<zend_function_entry>& methods) {
+    static const zend_function_entry method[] = {
+      ZEND_FENTRY(__toString, toString, arginfoNone, ZEND_ACC_PUBLIC)
+      PHP_FE_END
+    };
+    addInterfaceMethod(methods, method[0]);
+  }
+  // PHP 7 has no Stringable interface, __toString() is all there is
+  static void implement() {}
+};
+
+template<class T, bool = hasToArray<T, zend_array*() const>::value>
+struct jsonInterface {
+  static void addMethods(std::vector<zend_function_entry>& methods) {}
+  static void implement() {}
+};
+template<class T>
+struct jsonInterface<T, true> {
+  static void jsonSerialize(INTERNAL_FUNCTION_PARAMETERS) {
+    if (zend_parse_parameters_none() == FAILURE) { return; }
+    callTranslated([&] {
+      const T *self = thisObject<T>(getThis());
+      if (self) { RETURN_ARR(self->toArray()); }
+    });
+  }
+  static void addMethods(std::vector<zend_function_entry>& methods) {
+    static const zend_function_entry method[] = {
+      ZEND_FENTRY(jsonSerialize, jsonSerialize, arginfoNone, ZEND_ACC_PUBLIC)
+      PHP_FE_END
+    };
+    addInterfaceMethod(methods, method[0]);
+  }
+  static void implement() {
+    // Looked up rather than linked, ext/json may be absent
+    auto iface = reinterpret_cast<zend_class_entry*>(zend_hash_str_find_ptr(
+      CG(class_table), "jsonserializable", sizeof("jsonserializable") - 1));
+    if (!iface && zend_hash_str_exists(&module_registry, "json",
+                                       sizeof("json") - 1)) {
+      // Loaded, but not started yet
+      zend_error(E_CORE_WARNING, "%s can't implement JsonSerializable, "
+                 "ext/json must be declared as a module dependency",
+                 ZSTR_VAL(T::class_entry->name));
+      return;
+    }
+    implementInterface(T::class_entry, iface);
+  }
+};
+
+template<class T, typename = void>
+struct binarySerializable { static constexpr bool value = false; };
+template<class T>
+struct binarySerializable<T, typename voidType<
+    decltype(std::declval<const T&>().writeBinary(std::declval<Buffer&>())),
+    decltype(std::declval<T&>().readBinary(std::declval<View&>()))>::type> {
+  static constexpr bool value = std::is_constructible<T>::value &&
+    std::is_convertible<
+      decltype(std::declval<T&>().readBinary(std::declval<View&>())),
+      bool>::value;
+};
+
+template<class T, bool = binarySerializable<T>::value>
+struct serializableInterface {
+  static void addMethods(std::vector<zend_function_entry>& methods) {}
+  static void implement() {}
+};
+template<class T>
+struct serializableInterface<T, true> {
+  // nullptr or false after an exception was thrown
+  static zend_string* serialize(zval *object) {
+    return callTranslated(static_cast<zend_string*>(nullptr), [object] {
+      const T *self = thisObject<T>(object);
+      if (!self) { return static_cast<zend_string*>(nullptr); }
+      Buffer buf;
+      self->writeBinary(buf);
+      return buf.release();
+    });
+  }
+  static bool unserialize(zval *object, const unsigned char *data,
+                          size_t len) {
+    return callTranslated(false, [=] {
+      T *self = thisObject<T>(object);
+      if (!self) { return false; }
+      View view(data, len);
+      return self->readBinary(view);
+    });
+  }
+  static void throwInvalid(zval *object) {
+    zend_throw_exception_ex(zend_ce_exception, 0,
+      "Invalid serialization data for %s object",
+      ZSTR_VAL(Z_OBJCE_P(object)->name));
+  }
+
+  // Class hooks (C: format)
+  static int serializeHook(zval *object, unsigned char **buffer,
+                           size_t *buf_len, zend_serialize_data *data) {
+    zend_string *str = serialize(object);
+    if (!str) {
+      return FAILURE;
+    }
+    *buffer = reinterpret_cast<unsigned char*>(
+      estrndup(ZSTR_VAL(str), ZSTR_LEN(str)));
+    *buf_len = ZSTR_LEN(str);
+    zend_string_release(str);
+    return SUCCESS;
+  }
+  static int unserializeHook(zval *object, zend_class_entry *ce,
+                             const unsigned char *buf, size_t buf_len,
+                             zend_unserialize_data *data) {
+    if (object_init_ex(object, ce) == FAILURE) {
+      return FAILURE;
+    }
+    return unserialize(object, buf, buf_len) ? SUCCESS : FAILURE;
+  }
+
+  // __serialize()/__unserialize(), preferred by the engine from PHP 7.4
+  static void serializeMethod(INTERNAL_FUNCTION_PARAMETERS) {
+    if (zend_parse_parameters_none() == FAILURE) { return; }
+    zend_string *str = serialize(getThis());
+    if (!str) {
+      return;
+    }
+    array_init_size(return_value, 1);
+    add_next_index_str(return_value, str);
+  }
+  static void unserializeMethod(INTERNAL_FUNCTION_PARAMETERS) {
+    HashTable *data;
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "h", &data) == FAILURE) {
+      return;
+    }
+    zval *blob = zend_hash_index_find(data, 0);
+    if (!blob || (Z_TYPE_P(blob) != IS_STRING) ||
+        !unserialize(getThis(),
+                     reinterpret_cast<unsigned char*>(Z_STRVAL_P(blob)),
+                     Z_STRLEN_P(blob))) {
+      if (!EG(exception)) {
+        throwInvalid(getThis());
+      }
+    }
+  }
+
+  static void addMethods(std::vector<zend_function_entry>& methods) {
+#if PHP_VERSION_ID >= 70400
+    static const zend_function_entry method[] = {
+      ZEND_FENTRY(__serialize, serializeMethod, arginfoNone, ZEND_ACC_PUBLIC)
+      ZEND_FENTRY(__unserialize, unserializeMethod, arginfoUnserialize,
+                  ZEND_ACC_PUBLIC)
+      PHP_FE_END
+    };
+    addInterfaceMethod(methods, method[0]);
+    addInterfaceMethod(methods, method[1]);
+#endif
+  }
+  static void implement() {
+    T::class_entry->serialize = serializeHook;
+    T::class_entry->unserialize = unserializeHook;
+  }
+};
+
+template<class T, typename = void>
+struct jsonWritable { static constexpr bool value = false; };
+template<class T>
+struct jsonWritable<T, typename voidType<decltype(
+    std::declval<const T&>().writeJson(std::declval<JsonWriter&>()))>::type> {
+  static constexpr bool value = true;
+};
+
+template<class T, bool = jsonWritable<T>::value>
+struct jsonWriterMethods {
+  static void addMethods(std::vector<zend_function_entry>& methods) {}
+};
+template<class T>
+struct jsonWriterMethods<T, true> {
+  static void toJson(INTERNAL_FUNCTION_PARAMETERS) {
+    if (zend_parse_parameters_none() == FAILURE) { return; }
+    const T *self = thisObject<T>(getThis());
+    if (!self) { return; }
+    smart_str buf{nullptr, 0};
+    JsonWriter json(buf);
+    const bool written = callTranslated(false, [&] {
+      self->writeJson(json);
+      return true;
+    });
+    if (!written) {
+      smart_str_free(&buf);
+      return;
+    }
+    if (!json.valid()) {
+      smart_str_free(&buf);
+      zend_throw_exception_ex(zend_ce_exception, 0,
+        "Inf and NaN cannot be JSON encoded");
+      return;
+    }
+    smart_str_0(&buf);
+    RETURN_NEW_STR(buf.s ? buf.s : ZSTR_EMPTY_ALLOC());
+  }
+  static void addMethods(std::vector<zend_function_entry>& methods) {
+    static const zend_function_entry method[] = {
+      ZEND_FENTRY(toJson, toJson, arginfoNone, ZEND_ACC_PUBLIC)
+      PHP_FE_END
+    };
+    addInterfaceMethod(methods, method[0]);
+  }
+};
+
+// The class's own methods, plus any required by the interfaces above
+template<class T>
+const zend_function_entry* interfaceMethods(
+    const zend_function_entry *methods) {
+  if (!countable<T>::value &&
+      !hasToString<T, zend_string*() const>::value &&
+      !hasToArray<T, zend_array*() const>::value &&
+      !binarySerializable<T>::value &&
+      !jsonWritable<T>::value) {
+    return methods;
+  }
+  // Referenced by the class entry for the life of the process
+  static std::vector<zend_function_entry> merged;
+  for (auto method = methods; method && method->fname; ++method) {
+    merged.push_back(*method);
+  }
+  countableInterface<T>::addMethods(merged);
+  stringableInterface<T>::addMethods(merged);
+  jsonInterface<T>::addMethods(merged);
+  serializableInterface<T>::addMethods(merged);
+  jsonWriterMethods<T>::addMethods(merged);
+  static const zend_function_entry end[] = { PHP_FE_END };
+  merged.push_back(end[0]);
+  return merged.data();
+}
+
+template<class T>
+void implementInterfaces() {
+  countableInterface<T>::implement();
+  if (isIterable<T>::value) {
+    implementInterface(T::class_entry, zend_ce_traversable);
+  }
+  stringableInterface<T>::implement();
+  jsonInterface<T>::implement();
+  serializableInterface<T>::implement();
 }
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// Inheritance (see initClassEntry<T, Base>)
+
+namespace {
+template<class T, class Base>
+struct parentClass {
+  static_assert(std::is_base_of<Base, T>::value,
+                "Wrapped class must derive from its parent");
+  static_assert(!trailingLayout<Base>::enabled,
+                "Classes declaring trailing_storage may not be extended");
+  static_assert(&T::handlers != &Base::handlers,
+                "Derived classes must declare their own handlers");
+
+  static zend_class_entry* entry() {
+    if (!Base::class_entry) {
+      zend_error_noreturn(E_CORE_ERROR,
+        "Parent class must be initialized before its subclasses");
+    }
+    // Code bound for Base finds it at the start of the object's block
+    // (see toObject), so Base must not be adjusted from T.
+    // The pointer is never dereferenced.
+    T *probe = reinterpret_cast<T*>(alignof(T) * 64);
+    if (static_cast<Base*>(probe) != reinterpret_cast<Base*>(probe)) {
+      zend_error_noreturn(E_CORE_ERROR,
+        "%s must be the first base of classes extending it",
+        ZSTR_VAL(Base::class_entry->name));
+    }
+    return Base::class_entry;
+  }
+
+  static void inheritProperties() {
+    propertyTable<T>::entries = propertyTable<Base>::entries;
+    propertyTable<T>::names = propertyTable<Base>::names;
+    propertyTable<T>::count = propertyTable<Base>::count;
+  }
+};
+
+template<class T>
+struct parentClass<T, void> {
+  static zend_class_entry* entry() { return nullptr; }
+  static void inheritProperties() {}
+};
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// Persistent shared instances (see P3_PERSISTENT_ME)
+
+template<class T>
+class Persistent {
+ public:
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "Persistent instances may not be over-aligned");
+
+  Persistent() : m_obj(&instance()) {}
+
+  static zend_class_entry *class_entry;
+  static zend_object_handlers handlers;
+
+  // Proxies only hold a pointer to persistent memory
+  static constexpr bool collectable = false;
+
+  const T* get() const { return m_obj; }
+  const T& operator*() const { return *m_obj; }
+  const T* operator->() const { return m_obj; }
+
+  // Build the shared instance, replacing any previous one
+  template<typename... Args>
+  static const T& init(Args&&... args) {
+    shutdown();
+    void *ptr = pemalloc(sizeof(T), 1);
+    storage() = new(ptr) T(std::forward<Args>(args)...);
+    return *storage();
+  }
+
+  // The shared instance, default constructed on first use
+  static const T& instance() {
+    if (UNEXPECTED(!storage())) {
+      return initDefault<T>();
+    }
+    return *storage();
+  }
+
+  static bool initialized() { return storage() != nullptr; }
+
+  static void shutdown() {
+    T *obj = storage();
+    if (obj) {
+      storage() = nullptr;
+      obj->~T();
+      pefree(obj, 1);
+    }
+  }
+
+  // A new proxy object for the current request
+  static zend_object* proxy() {
+    return allocObject<Persistent>(class_entry,
+      [](Persistent *ptr) { new(ptr) Persistent(); });
+  }
+
+ private:
+  static T*& storage() {
+    static T *obj = nullptr;
+    return obj;
+  }
+
+  template<class U> static typename
+    std::enable_if<std::is_constructible<U>::value, const U&>::type
+  initDefault() {
+    return init();
+  }
+
+  template<class U> static typename
+    std::enable_if<!std::is_constructible<U>::value, const U&>::type
+  initDefault() {
+    zend_error_noreturn(E_CORE_ERROR,
+      "Persistent instance used before p3::Persistent<>::init()");
+  }
+
+  const T *m_obj;
+};
 
 template<class T>
+zend_class_entry *Persistent<T>::class_entry;
+template<class T>
+zend_object_handlers Persistent<T>::handlers;
+
+namespace {
+template<typename M, M meth> struct persistentMethod;
+
+template<class T, typename R, typename... Args, R (T::*meth)(Args...) const>
+struct persistentMethod<R (T::*)(Args...) const, meth> {
+  static void invoke(INTERNAL_FUNCTION_PARAMETERS) {
+    callTranslated([&] {
+      auto self = thisObject<Persistent<T>>(getThis());
+      if (!self) { return; }
+      boundMethod<const T, R (T::*)(Args...) const, meth, R>
+        func{ self->get() };
+      callNative<R, Args...>(INTERNAL_FUNCTION_PARAM_PASSTHRU, func,
+        typename makeIndexSequence<sizeof...(Args)>::type());
+    });
+  }
+};
+} // null namespace
+
+/////////////////////////////////////////////////////////////////////////////
+
+template<class T, class Base = void>
 zend_class_entry* initClassEntry(
   const char *name,
-  const zend_function_entry *methods) {
+  const zend_function_entry *methods,
+  const PropertyEntry *properties = nullptr) {
+  typedef parentClass<T, Base> parent;
 
   zend_class_entry ce;
-  INIT_CLASS_ENTRY_EX(ce, name, strlen(name), methods);
-  T::class_entry = zend_register_internal_class(&ce);
+  INIT_CLASS_ENTRY_EX(ce, name, strlen(name), interfaceMethods<T>(methods));
+  T::class_entry = zend_register_internal_class_ex(&ce, parent::entry());
   T::class_entry->create_object = std::is_constructible<T>::value
     ? createObject<T> : createThrownObject<T>;
+  if (isIterable<T>::value) {
+    T::class_entry->get_iterator = getIterator<T>;
+  }
 
   memcpy(&T::handlers, zend_get_std_object_handlers(),
          sizeof(zend_object_handlers));
-  T::handlers.offset = sizeof(T);
+  T::handlers.offset = objectLayout<T>::offset;
   T::handlers.free_obj = dtorObject<T>;
   T::handlers.clone_obj = std::is_constructible<T,const T&>::value
     ? cloneObject<T> : nullptr;
   T::handlers.cast_object = castObject<T>;
-  T::handlers.compare = compareObject<T>;
+  T::handlers.compare = compareObject<T, Base>;
+  if (countable<T>::value) {
+    T::handlers.count_elements = countElements<T>;
+  }
+  if (hasOperators<T>::value) {
+    T::handlers.do_operation = doOperation<T, Base>;
+  }
+  initClosure<T>();
+  static_assert(isCollectable<T>::value || !gcVisitable<T>::value,
+                "Classes implementing gcVisit() must be collectable");
+  if (!isCollectable<T>::value) {
+    T::handlers.get_gc = getGcNone<T>;
+  } else if (gcVisitable<T>::value) {
+    T::handlers.get_gc = getGcVisit<T>;
+  }
+
+  if (properties) {
+    initPropertyTable<T>(properties);
+  } else {
+    parent::inheritProperties();
+  }
+  if (propertyTable<T>::entries) {
+    T::handlers.read_property = readProperty<T>;
+    T::handlers.write_property = writeProperty<T>;
+    T::handlers.has_property = hasProperty<T>;
+    T::handlers.unset_property = unsetProperty<T>;
+    T::handlers.get_property_ptr_ptr = getPropertyPtrPtr<T>;
+  }
+
+  typedef dimOps<T, zend_long> longDims;
+  typedef dimOps<T, const zend_string*> stringDims;
+  static_assert(longDims::checkable ||
+                (!longDims::readable && !longDims::writable),
+                "Integer offsets need bool contains(zend_long) const");
+  static_assert(stringDims::checkable ||
+                (!stringDims::readable && !stringDims::writable),
+                "String offsets need bool contains(const zend_string*) const");
+  if (longDims::readable || stringDims::readable) {
+    T::handlers.read_dimension = readDimension<T>;
+  }
+  if (longDims::writable || stringDims::writable) {
+    T::handlers.write_dimension = writeDimension<T>;
+  }
+  if (longDims::checkable || stringDims::checkable) {
+    T::handlers.has_dimension = hasDimension<T>;
+  }
+  if (longDims::erasable || stringDims::erasable) {
+    T::handlers.unset_dimension = unsetDimension<T>;
+  }
 
+  implementInterfaces<T>();
   return T::class_entry;
 }
 
@@ -476,5 +4199,6 @@ zend_class_entry* initClassEntry(
 
 #undef P3_CASTABLE_TYPES
 #undef P3_COMPARABLE_TYPES
+#undef P3_BINARY_OPERATORS
 } // namespace p3
 #endif